@@ -8,12 +8,17 @@
  *
  * */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* struct ucred, for SO_PEERCRED. */
+#endif
+
 #include <time.h>
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
@@ -21,12 +26,24 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <termios.h>
-#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 #include <sys/select.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* --- WEBCAM INTERFACE -------------------------------------------
  * Generic interfaces and data structures.
@@ -46,6 +63,9 @@ typedef struct {
   /* Opaque pointer to OS-specific state */
   void *internal;
 
+  /* Readable whenever a new frame is ready, or -1 if frames must be polled. */
+  int notify_fd;
+
   /* OS will write camera data somewhere, and we will be reading it from the
    * same place: we use a lock so only one of us uses it at any given time. */
   pthread_mutex_t lock;
@@ -70,28 +90,40 @@ void freeCameraList(CameraInfo *list);
 
 #define MODE_MIRROR 0
 #define MODE_NETWORK 1
+#define MODE_BROKER 2
 
 #define NET_ROLE_SERVER 0
 #define NET_ROLE_CLIENT 1
+#define NET_ROLE_STDIO 2
 
 #define VIEW_PIP 0
 #define VIEW_SPLIT 1
 
 struct editorConfig {
-  int screenrows; /* Number of rows that we can show */
-  int screencols; /* Number of cols that we can show */
+  atomic_int screenrows; /* Number of rows that we can show */
+  atomic_int screencols; /* Number of cols that we can show */
   int rawmode;    /* Is terminal raw mode enabled? */
-  char statusmsg[80];
+  int winch_pipe[2]; /* SIGWINCH self-pipe, [0] is select()ed on. */
+  char statusmsg[80];    /* Guarded by statusmsg_lock. */
   time_t statusmsg_time;
 
   /* Configurable Parameters */
-  int mode;       /* MODE_MIRROR or MODE_NETWORK */
-  int view_mode;  /* VIEW_PIP or VIEW_SPLIT */
-  int net_role;   /* NET_ROLE_SERVER or NET_ROLE_CLIENT */
+  int mode;       /* MODE_MIRROR, MODE_NETWORK or MODE_BROKER */
+  atomic_int view_mode; /* VIEW_PIP or VIEW_SPLIT */
+  int net_role;   /* NET_ROLE_SERVER, NET_ROLE_CLIENT or NET_ROLE_STDIO */
+  int stdio_fds[2]; /* Peer's end of stdin and stdout with --role stdio */
   int net_port;
   char net_ip[64];
   char camera_target[64]; /* specific camera ID or "dummy-..." */
   int list_cameras;       /* Check if we should list cameras and exit */
+  int vt_check;           /* Verify output with a virtual terminal */
+  int vt_selftest;        /* Verify it on synthetic screens and exit */
+  int encrypt;            /* Encrypt the call, the peer must do it too */
+  int progressive;        /* Send frames coarse first, for slow links */
+  int max_rate;           /* KB/s we may send, 0 for no limit */
+  int max_delay;          /* Late frames we receive are skipped, in ms */
+  int crypto_bench;       /* Measure the cost of encryption and exit */
+  int lz_bench;           /* Measure and check compression and exit */
 
   /* Density String Config */
   char density_arg[256];
@@ -101,8 +133,11 @@ struct editorConfig {
 
 #define DENSITY_ASCII_DEFAULT " .x?A@"
 #define DENSITY_UNICODE_DEFAULT " .x?▂▄▆█"
+/* Cells hold a glyph index in a byte, and 255 is CELL_UNKNOWN. */
+#define DENSITY_MAX_GLYPHS 255
 
 static struct editorConfig E;
+static pthread_mutex_t statusmsg_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* --- CONFIGURATION ENGINE ------------------------------------------------- */
 
@@ -130,12 +165,14 @@ struct config_option {
 struct config_enum_map mode_map[] = {
   {"mirror", MODE_MIRROR},
   {"network", MODE_NETWORK},
+  {"broker", MODE_BROKER},
   {NULL, 0}
 };
 
 struct config_enum_map role_map[] = {
   {"server", NET_ROLE_SERVER},
   {"client", NET_ROLE_CLIENT},
+  {"stdio", NET_ROLE_STDIO},
   {NULL, 0}
 };
 
@@ -144,9 +181,17 @@ struct config_option config_table[] = {
   {"mode", "App Mode", CONF_ENUM, &E.mode, mode_map},
   {"role", "Network Role", CONF_ENUM, &E.net_role, role_map},
   {"port", "Port", CONF_INT, &E.net_port, NULL},
-  {"ip", "Remote IP", CONF_STRING, E.net_ip, NULL},
+  {"ip", "Remote host", CONF_STRING, E.net_ip, NULL},
   {"camera", "Camera ID", CONF_STRING, E.camera_target, NULL},
   {"list-cameras", "List Cameras", CONF_BOOL, &E.list_cameras, NULL},
+  {"vt-check", "Verify Output", CONF_BOOL, &E.vt_check, NULL},
+  {"vt-selftest", "Verify Output Offline", CONF_BOOL, &E.vt_selftest, NULL},
+  {"encrypt", "Encrypt Call", CONF_BOOL, &E.encrypt, NULL},
+  {"progressive", "Progressive Frames", CONF_BOOL, &E.progressive, NULL},
+  {"max-rate", "Max Rate (KB/s)", CONF_INT, &E.max_rate, NULL},
+  {"max-delay", "Max Delay (ms)", CONF_INT, &E.max_delay, NULL},
+  {"crypto-bench", "Benchmark Encryption", CONF_BOOL, &E.crypto_bench, NULL},
+  {"lz-bench", "Benchmark Compression", CONF_BOOL, &E.lz_bench, NULL},
   {"density-string", "Density String", CONF_STRING, E.density_arg, NULL},
   {NULL, NULL, 0, NULL, NULL}
 };
@@ -375,15 +420,306 @@ int getDummyFrame(camera *cam, frame *outFrame) {
   return 1;
 }
 
+/* --- CAMERA BROKER --------------------------------------------------------
+ * Only one process at a time can own a webcam. The broker (--mode broker)
+ * opens it once and publishes every frame into a shared memory ring, that
+ * any number of local processes can read zero-copy with --camera broker.
+ *
+ * Frame n goes into slot n % BROKER_SLOTS, and only then the published
+ * counter is bumped, so readers always find the latest complete frame and
+ * have BROKER_SLOTS-1 frame times to copy it before it gets overwritten.
+ * The slot seq works as a seqlock: readers use the frame in place, then
+ * check with cameraFrameIntact() that seq didn't change meanwhile, and
+ * drop what they made of it if the broker lapped them.
+ * Every client also gets a notification fd over the broker unix socket,
+ * that becomes readable at each new frame: an eventfd on Linux, a pipe
+ * elsewhere. */
+
+#define BROKER_MAGIC 0x50504342 /* "PPCB" */
+#define BROKER_SLOTS 4
+#define BROKER_MAX_FRAME (1280 * 720 * 4)
+#define BROKER_MAX_CLIENTS 16
+#define BROKER_DATA_OFFSET 4096 /* Frames start page aligned. */
+#define BROKER_SHM_SIZE \
+  (BROKER_DATA_OFFSET + (size_t)BROKER_SLOTS * BROKER_MAX_FRAME)
+
+struct brokerShm {
+  unsigned int magic;
+  atomic_uint published;    /* Number of frames published so far. */
+  struct {
+    atomic_uint seq;        /* Frame number + 1, or 0 while being written. */
+    int width, height;
+  } slots[BROKER_SLOTS];
+};
+
+struct brokerClient {
+  struct brokerShm *shm;
+  unsigned char *data;
+  unsigned int reading;     /* Seq of the frame handed out last, */
+  int reading_slot;         /* and its slot. */
+  int sockfd;               /* Only used to notice the broker went away. */
+};
+
+int isBrokerCamera(void) {
+  return strcmp(E.camera_target, "broker") == 0 ||
+         strncmp(E.camera_target, "broker:", 7) == 0;
+}
+
+/* Directory for the broker sockets, where no other user can bind one
+ * first and feed fake frames to our clients: $XDG_RUNTIME_DIR, or else a
+ * 0700 directory of ours in /tmp. Returns -1 if neither is safe. */
+int brokerDir(char *dir, int len) {
+  struct stat st;
+  const char *xdg = getenv("XDG_RUNTIME_DIR");
+  if (xdg && xdg[0] == '/' && stat(xdg, &st) == 0 && S_ISDIR(st.st_mode) &&
+      st.st_uid == getuid() && (st.st_mode & 077) == 0)
+  {
+    return snprintf(dir, len, "%s", xdg) < len ? 0 : -1;
+  }
+  snprintf(dir, len, "/tmp/picturephone-%u", (unsigned int)getuid());
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST) return -1;
+  if (lstat(dir, &st) == -1 || !S_ISDIR(st.st_mode) ||
+      st.st_uid != getuid() || (st.st_mode & 077) != 0) return -1;
+  return 0;
+}
+
+/* Shared memory and socket names of our broker for the given device. The
+ * id and our uid are hashed since macOS limits shared memory names to 31
+ * characters. Returns -1 if there is no safe place for the socket. */
+int brokerNames(const char *device, char *shm_name, char *sock_path,
+                int sock_len) {
+  unsigned int h = 2166136261u; /* FNV-1a */
+  if (device[0] == '\0') device = "default";
+  for (const char *c = device; *c; c++) h = (h ^ (unsigned char)*c) * 16777619u;
+  for (unsigned int uid = getuid(), i = 0; i < 4; i++, uid >>= 8)
+    h = (h ^ (uid & 0xff)) * 16777619u;
+  snprintf(shm_name, 32, "/picturephone-%08x", h);
+
+  char dir[256];
+  if (brokerDir(dir, sizeof(dir)) == -1) return -1;
+  int n = snprintf(sock_path, sock_len, "%s/picturephone-%08x.sock", dir, h);
+  return n < sock_len ? 0 : -1;
+}
+
+/* Device a --camera broker[:<id>] target refers to. */
+const char *brokerDevice(void) {
+  return E.camera_target[6] == ':' ? E.camera_target + 7 : "default";
+}
+
+int brokerAddress(const char *device, struct sockaddr_un *addr,
+                  char *shm_name) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  return brokerNames(device, shm_name, addr->sun_path, sizeof(addr->sun_path));
+}
+
+/* Is the process at the other end of the unix socket 's' run by us? */
+int brokerPeerIsUs(int s) {
+#ifdef __linux__
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) return 0;
+  return cred.uid == getuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(s, &uid, &gid) == -1) return 0;
+  return uid == getuid();
+#endif
+}
+
+/* Pass a file descriptor over a unix socket, along with one dummy byte. */
+int brokerSendFd(int sock, int fd) {
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  memset(&ctl, 0, sizeof(ctl));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+  return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+int brokerRecvFd(int sock) {
+  char byte;
+  struct iovec iov = {&byte, 1};
+  union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl.buf;
+  msg.msg_controllen = sizeof(ctl.buf);
+  if (recvmsg(sock, &msg, 0) != 1) return -1;
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+    return -1;
+  int fd;
+  memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+  return fd;
+}
+
+/* Non blocking notification channel: fds[0] is handed to a client, and
+ * fds[1] is written by the broker. They are the same eventfd on Linux. */
+int brokerNotifyChannel(int fds[2]) {
+#ifdef __linux__
+  fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK);
+  return fds[0] == -1 ? -1 : 0;
+#else
+  if (pipe(fds) == -1) return -1;
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  return 0;
+#endif
+}
+
+void brokerNotify(int fd) {
+#ifdef __linux__
+  unsigned long long one = 1;
+  write(fd, &one, sizeof(one));
+#else
+  write(fd, "f", 1); /* If the pipe is full the client is notified anyway. */
+#endif
+}
+
+void appendBrokerCameras(CameraInfo *list, int *idx) {
+  struct sockaddr_un addr;
+  char shm_name[32];
+  if (brokerAddress("default", &addr, shm_name) == 0 &&
+      access(addr.sun_path, F_OK) == 0) {
+    strcpy(list[*idx].name, "Camera Broker (shared default camera)");
+    strcpy(list[*idx].id, "broker");
+    (*idx)++;
+  }
+}
+
+int initBrokerCamera(camera *cam) {
+  if (!isBrokerCamera()) return 0;
+
+  struct sockaddr_un addr;
+  char shm_name[32];
+  int s = -1;
+  if (brokerAddress(brokerDevice(), &addr, shm_name) == 0)
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s == -1 || connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "Error: no camera broker running for '%s', start one "
+        "with --mode broker.\n", brokerDevice());
+    exit(1);
+  }
+  if (!brokerPeerIsUs(s)) {
+    fprintf(stderr, "Error: the camera broker is run by another user.\n");
+    exit(1);
+  }
+
+  /* The shared memory must be ours too, like the broker. */
+  int notify_fd = brokerRecvFd(s);
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  void *map = MAP_FAILED;
+  struct stat st;
+  if (fd != -1 && fstat(fd, &st) == 0 && st.st_uid == getuid())
+    map = mmap(NULL, BROKER_SHM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (fd != -1) close(fd);
+  if (notify_fd == -1 || map == MAP_FAILED ||
+      ((struct brokerShm *)map)->magic != BROKER_MAGIC) {
+    fprintf(stderr, "Error: can't attach to the camera broker.\n");
+    exit(1);
+  }
+
+  struct brokerClient *bc = malloc(sizeof(*bc));
+  bc->shm = map;
+  bc->data = (unsigned char *)map + BROKER_DATA_OFFSET;
+  bc->reading = 0;
+  bc->reading_slot = 0;
+  bc->sockfd = s;
+  cam->internal = bc;
+  cam->notify_fd = notify_fd;
+  cam->currentFrame.pixels = NULL;
+  pthread_mutex_init(&cam->lock, NULL);
+  return 1;
+}
+
+int startBrokerCamera(camera *cam) {
+  if (isBrokerCamera()) {
+    cam->isRunning = 1;
+    return 1;
+  }
+  return 0;
+}
+
+/* Point the frame straight at the latest slot in shared memory. The
+ * broker may rewrite it while it is used: see cameraFrameIntact(). */
+int getBrokerFrame(camera *cam, frame *outFrame) {
+  if (!isBrokerCamera()) return 0;
+
+  struct brokerClient *bc = cam->internal;
+  unsigned int n = atomic_load(&bc->shm->published);
+  if (n == 0) return 0;
+  int slot = (n - 1) % BROKER_SLOTS;
+  if (atomic_load(&bc->shm->slots[slot].seq) != n) return 0; /* Overwritten */
+
+  int w = bc->shm->slots[slot].width;
+  int h = bc->shm->slots[slot].height;
+  if (w <= 0 || h <= 0 || (size_t)w * h * 4 > BROKER_MAX_FRAME) return 0;
+  bc->reading = n;
+  bc->reading_slot = slot;
+  outFrame->width = w;
+  outFrame->height = h;
+  outFrame->pixels = bc->data + (size_t)slot * BROKER_MAX_FRAME;
+  return 1;
+}
+
+/* Once done reading the last frame cameraGetFrame() returned: was it left
+ * alone meanwhile? Only broker frames can change under the reader. */
+int cameraFrameIntact(camera *cam) {
+  if (!isBrokerCamera()) return 1;
+  struct brokerClient *bc = cam->internal;
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load(&bc->shm->slots[bc->reading_slot].seq) == bc->reading;
+}
+
+/* Wait up to timeout_ms for the broker to publish a frame. Returns 1 when
+ * there is a new frame. If the broker goes away the camera falls back to
+ * being polled, and keeps showing the last frame. */
+int brokerWaitFrame(camera *cam, int timeout_ms) {
+  struct brokerClient *bc = cam->internal;
+  int fd = cam->notify_fd;
+  fd_set readfds;
+  FD_ZERO(&readfds);
+  FD_SET(fd, &readfds);
+  FD_SET(bc->sockfd, &readfds);
+  int maxfd = fd > bc->sockfd ? fd : bc->sockfd;
+  struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+  if (select(maxfd+1, &readfds, NULL, NULL, &tv) <= 0) return 0;
+
+  char buf[64];
+  if (FD_ISSET(bc->sockfd, &readfds) && read(bc->sockfd, buf, 1) <= 0) {
+    close(fd);
+    cam->notify_fd = -1;
+    return 0;
+  }
+  if (!FD_ISSET(fd, &readfds)) return 0;
+  while (read(fd, buf, sizeof(buf)) > 0); /* Drain. */
+  return 1;
+}
+
 /* --- DEVICE/OS WEBCAM IMPLEMENTATIONS ------------------------------------- */
 
 #ifdef __linux__
 // TODO: Implement Linux/V4L2 support
 
 CameraInfo *enumerateCameras(void) {
-  CameraInfo *list = malloc(sizeof(CameraInfo) * 4);
+  CameraInfo *list = malloc(sizeof(CameraInfo) * 5);
   int idx = 0;
 
+  appendBrokerCameras(list, &idx);
   appendDummyCameras(list, &idx);
 
   list[idx].name[0] = '\0';
@@ -397,16 +733,19 @@ void freeCameraList(CameraInfo *list) {
 void cameraInit(camera *cam, int width, int height) {
   (void)width; (void)height;
   if (initDummyCamera(cam)) return;
+  if (initBrokerCamera(cam)) return;
   // Stub
 }
 
 void cameraStart(camera *cam) {
   if (startDummyCamera(cam)) return;
+  if (startBrokerCamera(cam)) return;
   // Stub
 }
 
 int cameraGetFrame(camera *cam, frame *outFrame) {
   if (getDummyFrame(cam, outFrame)) return 1;
+  if (getBrokerFrame(cam, outFrame)) return 1;
   // Stub
   return 0;
 }
@@ -486,8 +825,8 @@ CameraInfo *enumerateCameras(void) {
     count = MSG_RET_ULONG(devices, "count");
   }
 
-  // Allocate list: Real cameras + 3 dummies + 1 terminator
-  CameraInfo *list = malloc(sizeof(CameraInfo) * (count + 4));
+  // Allocate list: Real cameras + broker + 3 dummies + 1 terminator
+  CameraInfo *list = malloc(sizeof(CameraInfo) * (count + 5));
 
   int idx = 0;
   for (unsigned long i = 0; i < count; i++) {
@@ -503,7 +842,8 @@ CameraInfo *enumerateCameras(void) {
     idx++;
   }
 
-  // Add Dummies
+  // Add Broker and Dummies
+  appendBrokerCameras(list, &idx);
   appendDummyCameras(list, &idx);
 
   // Terminator
@@ -567,6 +907,7 @@ void cameraInit(camera *cam, int width, int height) {
   (void)width; (void)height;
 
   if (initDummyCamera(cam)) return;
+  if (initBrokerCamera(cam)) return;
 
   // Setup global context for the static callback
   global_cam_context = cam;
@@ -650,6 +991,7 @@ void cameraInit(camera *cam, int width, int height) {
 
 void cameraStart(camera *cam) {
   if (startDummyCamera(cam)) return;
+  if (startBrokerCamera(cam)) return;
   id session = (id)cam->internal;
   VMSG(session, "startRunning");
   cam->isRunning = 1;
@@ -657,6 +999,7 @@ void cameraStart(camera *cam) {
 
 int cameraGetFrame(camera *cam, frame *outFrame) {
   if (getDummyFrame(cam, outFrame)) return 1;
+  if (getBrokerFrame(cam, outFrame)) return 1;
 
   pthread_mutex_lock(&cam->lock);
   if (cam->currentFrame.pixels) {
@@ -896,25 +1239,74 @@ void abFree(struct abuf *ab) {
   free(ab->b);
 }
 
+/* Empty the buffer so that it can be reused, resizing its allocation to
+ * 'cap' bytes if that is not zero. */
+void abReset(struct abuf *ab, int cap) {
+  if (cap > 0 && cap != ab->cap) {
+    char *new = realloc(ab->b, cap);
+    if (new != NULL) {
+      ab->b = new;
+      ab->cap = cap;
+    }
+  }
+  ab->len = 0;
+}
+
+/* The size is read by the other stages while the main thread changes it,
+ * so it is only ever stored and loaded atomically. */
 void updateWindowSize(void) {
-  if (getWindowSize(STDIN_FILENO,STDOUT_FILENO,
-        &E.screenrows,&E.screencols) == -1) {
+  int rows, cols;
+  if (getWindowSize(STDIN_FILENO,STDOUT_FILENO,&rows,&cols) == -1) {
     perror("Unable to query the screen for size (columns / rows)");
     exit(1);
   }
-  E.screenrows--;
+  atomic_store(&E.screencols, cols);
+  atomic_store(&E.screenrows, rows - 1);
 }
 
+/* Querying the window size may involve terminal I/O, which has no place
+ * in a signal handler: the handler just pokes a pipe, and the main loop
+ * calls handleWindowResize() when the pipe becomes readable. */
 void handleSigWinCh(int unused __attribute__((unused))) {
-  updateWindowSize();
+  int saved_errno = errno;
+  char c = 0;
+  if (write(E.winch_pipe[1], &c, 1) == -1) {
+    /* Pipe full: a resize is already pending. */
+  }
+  errno = saved_errno;
+}
+
+/* Drain the SIGWINCH pipe and update the window size if it was poked.
+ * Returns 1 if the window was resized. */
+int handleWindowResize(void) {
+  char buf[64];
+  int resized = 0;
+  while (read(E.winch_pipe[0], buf, sizeof(buf)) > 0) resized = 1;
+  if (resized) updateWindowSize();
+  return resized;
 }
 
+/* Any thread may set the status message, while the compose stage draws
+ * it: both sides go through statusmsg_lock. */
 void editorSetStatusMessage(const char *fmt, ...) {
   va_list ap;
   va_start(ap,fmt);
+  pthread_mutex_lock(&statusmsg_lock);
   vsnprintf(E.statusmsg,sizeof(E.statusmsg),fmt,ap);
-  va_end(ap);
   E.statusmsg_time = time(NULL);
+  pthread_mutex_unlock(&statusmsg_lock);
+  va_end(ap);
+}
+
+/* Copy the status message into 'buf', or an empty string once it is older
+ * than 5 seconds. */
+void editorGetStatusMessage(char *buf, size_t size) {
+  pthread_mutex_lock(&statusmsg_lock);
+  if (time(NULL) - E.statusmsg_time < 5)
+    snprintf(buf, size, "%s", E.statusmsg);
+  else
+    buf[0] = '\0';
+  pthread_mutex_unlock(&statusmsg_lock);
 }
 
 /* --- DENSITY STRING HANDLING ---------------------------------------------- */
@@ -955,10 +1347,10 @@ void freeDensityGlyphs(void) {
 void setDensityString(const char *str) {
   freeDensityGlyphs();
 
-  // First pass: count glyphs
+  // First pass: count glyphs, ignoring any past DENSITY_MAX_GLYPHS
   int count = 0;
   const char *p = str;
-  while (*p) {
+  while (*p && count < DENSITY_MAX_GLYPHS) {
     int len = get_utf8_char_len((unsigned char)*p);
     p += len;
     count++;
@@ -1005,6 +1397,13 @@ void initEditor(void) {
   E.net_role = NET_ROLE_SERVER;
   E.net_port = 3000;
   E.list_cameras = 0;
+  E.vt_check = 0;
+  E.vt_selftest = 0;
+  E.encrypt = 0;
+  E.max_rate = 0;
+  E.max_delay = 500;
+  E.crypto_bench = 0;
+  E.lz_bench = 0;
   E.camera_target[0] = '\0';
   strcpy(E.net_ip, "127.0.0.1");
 
@@ -1012,11 +1411,17 @@ void initEditor(void) {
   E.density_count = 0;
   E.density_arg[0] = '\0';
 
-  updateWindowSize();
+  if (pipe(E.winch_pipe) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  fcntl(E.winch_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.winch_pipe[1], F_SETFL, O_NONBLOCK);
   signal(SIGWINCH, handleSigWinCh);
 }
 
 void initTerminal(void) {
+  updateWindowSize();
   // Clear screen
   write(STDOUT_FILENO, "\x1b[2J", 4);
 }
@@ -1024,14 +1429,44 @@ void initTerminal(void) {
 /* --- VIDEO TO GRAYSCALE TO ASCII ------------------------------------------ */
 
 void renderStatus(struct abuf *ab) {
-  int cols = E.screencols;
+  int cols = atomic_load(&E.screencols);
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows + 1);
+  snprintf(buf, sizeof(buf), "\x1b[%d;1H", atomic_load(&E.screenrows) + 1);
   abAppend(ab, buf, strlen(buf));
   abAppend(ab, "\x1b[0K", 4);
-  int msglen = strlen(E.statusmsg);
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen <= cols ? msglen : cols);
+  char msg[sizeof(E.statusmsg)];
+  editorGetStatusMessage(msg, sizeof(msg));
+  int msglen = strlen(msg);
+  if (msglen) abAppend(ab, msg, msglen <= cols ? msglen : cols);
+}
+
+/* Webcams keep adjusting exposure and gain, and since pictures are drawn
+ * stretched to their own min..max range, every small global drift changes
+ * the glyph of almost every cell: a full repaint. So once the range has
+ * converged it is locked, and a new one is adopted only when the scene
+ * brightness moves at either end by more than a RANGE_SLACK_DIV'th of the
+ * locked range: a dim scene spread over a few levels is as sensitive to a
+ * small drift as a bright one to a large drift. */
+#define RANGE_SLACK_DIV 10
+#define RANGE_SLACK_MIN 3  /* Levels, so that noise doesn't unlock it. */
+
+typedef struct {
+  int min, max;
+  int locked;
+} rangeLock;
+
+/* Replace the measured range with the locked one, adopting it if needed. */
+void rangeLockApply(rangeLock *l, int *min, int *max) {
+  int slack = (l->max - l->min) / RANGE_SLACK_DIV;
+  if (slack < RANGE_SLACK_MIN) slack = RANGE_SLACK_MIN;
+  if (!l->locked || abs(*min - l->min) > slack ||
+      abs(*max - l->max) > slack) {
+    l->min = *min;
+    l->max = *max;
+    l->locked = 1;
+  }
+  *min = l->min;
+  *max = l->max;
 }
 
 // Helper to convert an image buffer (grayscale) to ASCII in the abuf
@@ -1083,7 +1518,8 @@ void renderBuffer(struct abuf *ab, unsigned char *pixels, int w, int h,
 
 // Helper to convert an image buffer (BGRA) to ASCII in the abuf
 void renderBufferBGRA(struct abuf *ab, unsigned char *pixels, int w, int h,
-    int x_off, int y_off, int target_w, int target_h, int mirror) {
+    int x_off, int y_off, int target_w, int target_h, int mirror,
+    rangeLock *lock) {
   if (target_w <= 0 || target_h <= 0) return;
 
   int min = 255, max = 0;
@@ -1107,6 +1543,7 @@ void renderBufferBGRA(struct abuf *ab, unsigned char *pixels, int w, int h,
       if (v > max) max = v;
     }
   }
+  if (lock) rangeLockApply(lock, &min, &max);
   int range = max - min;
   if (range == 0) range = 1;
 
@@ -1145,406 +1582,4545 @@ void renderAsciiFrame(struct abuf *ab, unsigned char *pixels, int w, int h) {
   renderStatus(ab);
 }
 
-/* --- NETWORK MODE --------------------------------------------------------- */
+/* --- SCREEN GRID ---------------------------------------------------------- */
 
-// Downscale and grayscale conversion for network transport (Legacy/Unused)
-// void resizeAndGray(frame *in, unsigned char *out) ...
+/* Network mode doesn't render pictures straight into escape sequences:
+ * it renders them into a grid holding one density glyph index per cell,
+ * and then compares that grid with the one describing what the terminal
+ * already shows. Only the cells that changed are emitted, so redrawing the
+ * screen every time a slice of a picture arrives costs just that slice. */
 
+#define CELL_UNKNOWN 255 /* Not drawn / terminal content unknown. */
 
-int tcpListen(int port) {
-  int server_fd, new_socket;
-  struct sockaddr_in address;
-  int opt = 1;
-  int addrlen = sizeof(address);
+typedef struct {
+  int rows;
+  int cols;
+  unsigned char *cells;
+} cellGrid;
 
-  if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-    perror("socket failed");
-    exit(EXIT_FAILURE);
-  }
+typedef struct {
+  int x, y, w, h;
+} rect;
 
-  // Forcefully attach socket to the port
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-    perror("setsockopt");
-    exit(EXIT_FAILURE);
-  }
+/* Set every cell of the grid to CELL_UNKNOWN. */
+void gridInvalidate(cellGrid *g) {
+  memset(g->cells, CELL_UNKNOWN, g->rows * g->cols);
+}
 
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(port);
+void gridResize(cellGrid *g, int rows, int cols) {
+  free(g->cells);
+  g->rows = rows;
+  g->cols = cols;
+  g->cells = malloc(rows * cols > 0 ? rows * cols : 1);
+  gridInvalidate(g);
+}
 
-  if (bind(server_fd, (struct sockaddr *)&address, sizeof(address))<0) {
-    perror("bind failed");
-    exit(EXIT_FAILURE);
-  }
+void gridFree(cellGrid *g) {
+  free(g->cells);
+  g->cells = NULL;
+}
 
-  if (listen(server_fd, 3) < 0) {
-    perror("listen");
-    exit(EXIT_FAILURE);
+/* Find the darkest and brightest pixels of a grayscale picture, used to
+ * stretch it over the whole density string. */
+void pictureRange(unsigned char *pixels, int w, int h, int *min, int *max) {
+  int lo = 255, hi = 0;
+  for (int i = 0; i < w * h; i++) {
+    if (pixels[i] < lo) lo = pixels[i];
+    if (pixels[i] > hi) hi = pixels[i];
   }
+  *min = lo;
+  *max = hi;
+}
 
-  fprintf(stderr, "Waiting for connection on port %d... (Ctrl+C to quit)\n",
-      port);
-
-  // Wait for connection with Ctrl+C support
-  while(1) {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
-    FD_SET(server_fd, &readfds);
+/* Which picture pixel every cell of a rect samples, so that rendering
+ * doesn't need two divisions per cell. Tables are rebuilt only when the
+ * layout or the size of the picture changes. */
+typedef struct {
+  int w, h;         /* Picture size. */
+  rect r;           /* Where the picture is drawn. */
+  int mirror;
+  int *xmap;        /* Picture column for every column of 'r'. */
+  int *ymap;        /* Picture row for every row of 'r'. */
+} samplingTable;
+
+void samplingTableUpdate(samplingTable *t, int w, int h, rect r, int mirror) {
+  if (t->xmap && t->w == w && t->h == h && t->mirror == mirror &&
+      memcmp(&t->r, &r, sizeof(r)) == 0) return;
+
+  free(t->xmap);
+  free(t->ymap);
+  t->w = w;
+  t->h = h;
+  t->r = r;
+  t->mirror = mirror;
+  t->xmap = malloc(sizeof(int) * (r.w > 0 ? r.w : 1));
+  t->ymap = malloc(sizeof(int) * (r.h > 0 ? r.h : 1));
+  for (int x = 0; x < r.w; x++) {
+    int ix = mirror ? ((r.w-1-x)*w)/r.w : (x*w)/r.w;
+    t->xmap[x] = ix >= w ? w-1 : ix;
+  }
+  for (int y = 0; y < r.h; y++) {
+    int iy = (y*h)/r.h;
+    t->ymap[y] = iy >= h ? h-1 : iy;
+  }
+}
 
-    if (select(server_fd + 1, &readfds, NULL, NULL, NULL) < 0) {
-      if (errno == EINTR) continue;
-      perror("select");
-      exit(EXIT_FAILURE);
-    }
+void samplingTableFree(samplingTable *t) {
+  free(t->xmap);
+  free(t->ymap);
+  t->xmap = t->ymap = NULL;
+}
 
-    // Check for Ctrl+C
-    if (FD_ISSET(STDIN_FILENO, &readfds)) {
-      char c;
-      if (read(STDIN_FILENO, &c, 1) == 1) {
-        if (c == CTRL_C) {
-          write(STDOUT_FILENO, "\r\n", 2);
-          exit(0);
-        }
-      }
-    }
+/* Like renderBuffer(), but into the grid, sampling the picture as the
+ * table says, and normalizing it with the given range instead of
+ * computing its own. */
+void gridRenderPicture(cellGrid *g, unsigned char *pixels, samplingTable *t,
+    int min, int max) {
+  rect r = t->r;
+  if (r.w <= 0 || r.h <= 0 || E.density_count == 0) return;
 
-    // Check for Incoming Connection
-    if (FD_ISSET(server_fd, &readfds)) {
-      if ((new_socket = accept(server_fd,
-              (struct sockaddr *)&address,
-              (socklen_t*)&addrlen)) < 0) {
-        perror("accept");
-        exit(EXIT_FAILURE);
-      }
-      break;
+  int d_max = E.density_count - 1;
+  int range = max - min;
+  if (range <= 0) range = 1;
+
+  for (int y = 0; y < r.h; y++) {
+    int gy = r.y + y;
+    if (gy < 0 || gy >= g->rows) continue;
+
+    unsigned char *src = pixels + t->ymap[y] * t->w;
+    unsigned char *row = g->cells + gy * g->cols;
+    for (int x = 0; x < r.w; x++) {
+      int gx = r.x + x;
+      if (gx < 0 || gx >= g->cols) continue;
+
+      int idx = (src[t->xmap[x]] - min) * d_max / range;
+      if (idx < 0) idx = 0;
+      if (idx > d_max) idx = d_max;
+      row[gx] = idx;
     }
   }
-
-  fprintf(stderr, "Connected!\n");
-  return new_socket;
 }
 
-int tcpConnect(const char *ip, int port) {
-  int sock = 0;
-  struct sockaddr_in serv_addr;
+/* Cursor motion planning, in the spirit of curses' mvcur(): to reach the
+ * next changed cell there are several ways of moving the cursor, and which
+ * one is the shortest depends on where the cursor is. Every candidate is
+ * written into a small buffer, and the shortest one wins. Candidates are:
+ *
+ *   absolute:   CUP  ESC [ row ; col H
+ *   vertical:   LF (the terminal is in raw mode, so it keeps the column),
+ *               or CUD  ESC [ n B
+ *   horizontal: CUF  ESC [ n C,  CUB  ESC [ n D,  CHA  ESC [ col G,
+ *               CR, or re-emitting the unchanged glyphs in between, whose
+ *               length in bytes comes from the density table.
+ *
+ * The cursor is "unknown" at the start of every update, and after writing
+ * the last column, since terminals disagree about what happens next. */
 
-  if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    perror("Socket creation error");
-    exit(EXIT_FAILURE);
-  }
+#define MOVE_MAX 64 /* Longer motions never beat an absolute CUP. */
 
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_port = htons(port);
+typedef struct {
+  int y, x; /* Cursor position, y = -1 if unknown. */
+  int glyph_len[256]; /* Bytes of every density glyph. */
+} cursorState;
+
+/* Append a CSI sequence with numeric argument 'n' to 'buf'. The argument is
+ * omitted when it is 1, the default. Returns the new length. */
+int moveCSI(char *buf, int len, int n, char final) {
+  if (n == 1)
+    return len + snprintf(buf + len, MOVE_MAX - len, "\x1b[%c", final);
+  return len + snprintf(buf + len, MOVE_MAX - len, "\x1b[%d%c", n, final);
+}
 
-  if(inet_pton(AF_INET, ip, &serv_addr.sin_addr)<=0) {
-    perror("Invalid address/ Address not supported");
-    exit(EXIT_FAILURE);
+/* Write the cheapest way to move along a row from column 'from' to 'to'
+ * into buf+len. 'have' holds what the terminal shows on the row. Returns
+ * the new length. */
+int moveHorizontal(cursorState *cs, char *buf, int len,
+    unsigned char *have, int from, int to) {
+  char best[MOVE_MAX], cand[MOVE_MAX];
+  int best_len, cand_len;
+  if (from == to) return len;
+
+  /* CHA, always possible. */
+  best_len = snprintf(best, MOVE_MAX, "\x1b[%dG", to + 1);
+
+  /* CUF / CUB. */
+  cand_len = moveCSI(cand, 0, to > from ? to - from : from - to,
+      to > from ? 'C' : 'D');
+  if (cand_len < best_len) {
+    memcpy(best, cand, cand_len);
+    best_len = cand_len;
   }
 
-  // Set non-blocking to handle Ctrl+C during connect
-  fcntl(sock, F_SETFL, O_NONBLOCK);
-
-  fprintf(stderr, "Connecting to %s:%d... (Ctrl+C to quit)\n", ip, port);
-
-  int ret = connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
-  if (ret < 0 && errno != EINPROGRESS) {
-    perror("Connection Failed");
-    exit(EXIT_FAILURE);
+  /* CR, then forward from the first column. */
+  if (to < from) {
+    cand[0] = '\r';
+    cand_len = moveHorizontal(cs, cand, 1, have, 0, to);
+    if (cand_len < best_len) {
+      memcpy(best, cand, cand_len);
+      best_len = cand_len;
+    }
   }
 
-  if (ret == 0) {
-    // Connected immediately
-    fprintf(stderr, "Connected!\n");
-    return sock;
+  /* Re-emit what is already on screen. */
+  if (to > from) {
+    cand_len = 0;
+    for (int x = from; x < to && cand_len < best_len; x++) {
+      if (have[x] == CELL_UNKNOWN) {
+        cand_len = MOVE_MAX;
+        break;
+      }
+      int glen = cs->glyph_len[have[x]];
+      if (cand_len + glen > best_len) {
+        cand_len = MOVE_MAX;
+        break;
+      }
+      memcpy(cand + cand_len, E.density_glyphs[have[x]], glen);
+      cand_len += glen;
+    }
+    if (cand_len < best_len) {
+      memcpy(best, cand, cand_len);
+      best_len = cand_len;
+    }
   }
 
-  // Wait for connection completion
-  while(1) {
-    fd_set readfds, writefds;
-    FD_ZERO(&readfds);
-    FD_ZERO(&writefds);
-    FD_SET(STDIN_FILENO, &readfds);
-    FD_SET(sock, &writefds);
+  memcpy(buf + len, best, best_len);
+  return len + best_len;
+}
 
-    if (select(sock + 1, &readfds, &writefds, NULL, NULL) < 0) {
-      if (errno == EINTR) continue;
-      perror("select");
-      exit(EXIT_FAILURE);
+/* Append to 'ab' the cheapest motion from the cursor position to the cell
+ * at y,x of the front grid 'g'. */
+void moveCursor(struct abuf *ab, cursorState *cs, cellGrid *g, int y, int x) {
+  char best[MOVE_MAX], cand[MOVE_MAX];
+  int best_len, cand_len;
+
+  if (cs->y == y && cs->x == x) return;
+
+  /* CUP, always possible. */
+  if (y == 0 && x == 0) best_len = snprintf(best, MOVE_MAX, "\x1b[H");
+  else if (x == 0) best_len = snprintf(best, MOVE_MAX, "\x1b[%dH", y + 1);
+  else best_len = snprintf(best, MOVE_MAX, "\x1b[%d;%dH", y + 1, x + 1);
+
+  /* Down (we only ever move forward), then along the row. */
+  if (cs->y != -1 && y >= cs->y) {
+    int down = y - cs->y;
+    cand_len = moveCSI(cand, 0, down, 'B');
+    if (down == 0) cand_len = 0;
+    if (down < cand_len) {
+      memset(cand, '\n', down);
+      cand_len = down;
     }
-
-    // Check for Ctrl+C
-    if (FD_ISSET(STDIN_FILENO, &readfds)) {
-      char c;
-      if (read(STDIN_FILENO, &c, 1) == 1) {
-        if (c == CTRL_C) {
-          write(STDOUT_FILENO, "\r\n", 2);
-          exit(0);
-        }
-      }
+    cand_len = moveHorizontal(cs, cand, cand_len,
+        g->cells + y * g->cols, cs->x, x);
+    if (cand_len < best_len) {
+      memcpy(best, cand, cand_len);
+      best_len = cand_len;
     }
+  }
 
-    // Check for Connect Result
-    if (FD_ISSET(sock, &writefds)) {
-      int so_error;
-      socklen_t len = sizeof(so_error);
-      getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &len);
+  abAppend(ab, best, best_len);
+  cs->y = y;
+  cs->x = x;
+}
 
-      if (so_error == 0) {
-        break; // Connected!
-      } else {
-        fprintf(stderr, "Connection failed: %s\n", strerror(so_error));
-        exit(EXIT_FAILURE);
-      }
+/* Emit the escape sequences that turn the 'front' grid (what the terminal
+ * shows) into the 'back' grid (what we want it to show), and update 'front'
+ * accordingly. The cursor reaches every changed cell along the cheapest
+ * path, which is often just re-emitting a few unchanged glyphs. */
+void gridEmit(struct abuf *ab, cellGrid *back, cellGrid *front) {
+  cursorState cs;
+  cs.y = cs.x = -1;
+  for (int i = 0; i < E.density_count && i < 256; i++)
+    cs.glyph_len[i] = strlen(E.density_glyphs[i]);
+
+  for (int y = 0; y < back->rows; y++) {
+    unsigned char *want = back->cells + y * back->cols;
+    unsigned char *have = front->cells + y * front->cols;
+
+    for (int x = 0; x < back->cols; x++) {
+      if (want[x] == have[x] || want[x] == CELL_UNKNOWN) continue;
+
+      moveCursor(ab, &cs, front, y, x);
+      abAppend(ab, E.density_glyphs[want[x]], cs.glyph_len[want[x]]);
+      have[x] = want[x];
+
+      /* Past the last column the cursor position is up to the terminal. */
+      if (++cs.x == back->cols) cs.y = -1;
     }
   }
+}
 
-  // Reset to blocking (or keep non-blocking as runNetworkMode sets it anyway)
-  // fcntl(sock, F_SETFL, 0);
+/* --- VIRTUAL TERMINAL ----------------------------------------------------- */
 
-  fprintf(stderr, "Connected!\n");
-  return sock;
+/* A minimal model of a VT100/xterm-like terminal, just capable enough to
+ * understand what picturephone writes. With --vt-check the tty stage feeds
+ * it every byte it writes to the real terminal, and after each update
+ * compares the model with the screen compose wanted to draw: any output
+ * optimization (diffs, cursor motion planning, ...) is then verified while
+ * running, and bytes and escape sequences per update are measured. */
+
+typedef struct {
+  int rows, cols;
+  unsigned int *cells;    /* Packed UTF-8 bytes of the glyph in each cell. */
+  int y, x;               /* Cursor position. */
+  int wrap_pending;       /* Last column written: next glyph wraps. */
+  unsigned int last;      /* Last glyph printed, for REP. */
+
+  /* Parser state, since sequences can be split across writes. */
+  unsigned char seq[32];
+  int seqlen;
+  unsigned char utf8[4];
+  int utf8len, utf8need;
+
+  /* Statistics. */
+  long long updates;
+  long long bytes, escapes;
+  long long max_bytes;
+  char error[128];        /* Set on unsupported input or mismatch. */
+} vtModel;
+
+/* Pack the bytes of a UTF-8 glyph in a single integer. */
+unsigned int vtPackGlyph(const unsigned char *s, int len) {
+  unsigned int g = 0;
+  for (int i = 0; i < len && i < 4; i++) g |= (unsigned int)s[i] << (8*i);
+  return g;
 }
 
-long long current_timestamp(void) {
-  struct timeval te;
-  gettimeofday(&te, NULL);
-  long long milliseconds = te.tv_sec*1000LL + te.tv_usec/1000;
-  return milliseconds;
+void vtInit(vtModel *vt, int rows, int cols) {
+  free(vt->cells);
+  vt->rows = rows > 0 ? rows : 1;
+  vt->cols = cols > 0 ? cols : 1;
+  vt->cells = malloc(sizeof(unsigned int) * vt->rows * vt->cols);
+  for (int i = 0; i < vt->rows * vt->cols; i++) vt->cells[i] = ' ';
+  vt->y = vt->x = 0;
+  vt->wrap_pending = 0;
+  vt->last = ' ';
+  vt->seqlen = vt->utf8len = vt->utf8need = 0;
 }
 
-void redrawNetworkView(camera *cam, unsigned char *peer_pixels,
-    int p_w, int p_h) {
-  struct abuf ab = ABUF_INIT;
-  abAppend(&ab,"\x1b[?25l",6); /* Hide cursor. */
-  abAppend(&ab,"\x1b[H",3); /* Go home. */
+void vtFree(vtModel *vt) {
+  free(vt->cells);
+  vt->cells = NULL;
+}
 
-  if (E.view_mode == VIEW_PIP) {
-    /* Render Peer Fullscreen */
-    renderBuffer(&ab, peer_pixels, p_w, p_h, 0, 0,
-        E.screencols, E.screenrows, 1);
+void vtError(vtModel *vt, const char *fmt, ...) {
+  if (vt->error[0]) return; /* Keep the first one. */
+  va_list ap;
+  va_start(ap,fmt);
+  vsnprintf(vt->error,sizeof(vt->error),fmt,ap);
+  va_end(ap);
+}
 
-    /* Render Self Small (bottom right) */
-    frame my_frame;
-    if (cameraGetFrame(cam, &my_frame)) {
-      int sw = E.screencols / 4;
-      int sh = E.screenrows / 4;
-      if (sw < 10) sw = 10;
-      if (sh < 5) sh = 5;
-      renderBufferBGRA(&ab, my_frame.pixels, my_frame.width, my_frame.height,
-          E.screencols - sw - 2, E.screenrows - sh - 2, sw, sh, 1);
-    }
-  } else {
-    /* Split Screen */
-    int half_w = E.screencols / 2;
-    renderBuffer(&ab, peer_pixels, p_w, p_h, 0, 0, half_w, E.screenrows, 1);
+/* Blank cells from..to-1, counted from the top left corner. */
+void vtErase(vtModel *vt, int from, int to) {
+  for (int i = from; i < to; i++) vt->cells[i] = ' ';
+}
 
-    frame my_frame;
-    if (cameraGetFrame(cam, &my_frame)) {
-      renderBufferBGRA(&ab, my_frame.pixels, my_frame.width, my_frame.height,
-          half_w, 0, E.screencols - half_w, E.screenrows, 1);
-    }
+void vtLineFeed(vtModel *vt) {
+  if (vt->y < vt->rows - 1) {
+    vt->y++;
+    return;
   }
+  /* Scroll up. */
+  memmove(vt->cells, vt->cells + vt->cols,
+      sizeof(unsigned int) * (vt->rows - 1) * vt->cols);
+  vtErase(vt, (vt->rows - 1) * vt->cols, vt->rows * vt->cols);
+}
 
-  renderStatus(&ab);
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+void vtPutGlyph(vtModel *vt, unsigned int g) {
+  if (vt->wrap_pending) {
+    vt->x = 0;
+    vtLineFeed(vt);
+    vt->wrap_pending = 0;
+  }
+  vt->cells[vt->y * vt->cols + vt->x] = g;
+  vt->last = g;
+  if (vt->x == vt->cols - 1) vt->wrap_pending = 1;
+  else vt->x++;
 }
 
-void runNetworkMode(camera *cam) {
-  int sockfd;
+/* Execute the CSI sequence in vt->seq. */
+void vtExecCSI(vtModel *vt) {
+  int params[4] = {0, 0, 0, 0}, nparams = 0;
+  int private = vt->seq[2] == '?';
+  char final = vt->seq[vt->seqlen - 1];
+
+  for (int i = 2 + private; i < vt->seqlen - 1; i++) {
+    unsigned char c = vt->seq[i];
+    if (c == ';') {
+      if (++nparams == 4) break;
+    } else if (c >= '0' && c <= '9') {
+      params[nparams] = params[nparams] * 10 + (c - '0');
+    } else {
+      vtError(vt, "unsupported CSI parameter '%c'", c);
+      return;
+    }
+  }
+  int n = params[0] ? params[0] : 1;
 
-  // Establish Connection
-  if (E.net_role == NET_ROLE_SERVER) {
-    sockfd = tcpListen(E.net_port);
-  } else {
-    sockfd = tcpConnect(E.net_ip, E.net_port);
+  if (private) {
+    /* Only cursor visibility and the like: no effect on the cells. */
+    if (final != 'h' && final != 'l')
+      vtError(vt, "unsupported private CSI '%c'", final);
+    return;
   }
 
-  // Set socket non-blocking
-  fcntl(sockfd, F_SETFL, O_NONBLOCK);
+  switch(final) {
+    case 'H': case 'f':
+      vt->y = (params[0] ? params[0] : 1) - 1;
+      vt->x = (params[1] ? params[1] : 1) - 1;
+      break;
+    case 'A': vt->y -= n; break;
+    case 'B': vt->y += n; break;
+    case 'C': vt->x += n; break;
+    case 'D': vt->x -= n; break;
+    case 'G': vt->x = n - 1; break;
+    case 'J': {
+      int cursor = vt->y * vt->cols + vt->x;
+      if (params[0] == 0) vtErase(vt, cursor, vt->rows * vt->cols);
+      else if (params[0] == 1) vtErase(vt, 0, cursor + 1);
+      else vtErase(vt, 0, vt->rows * vt->cols);
+      return;
+    }
+    case 'K': {
+      int start = vt->y * vt->cols;
+      if (params[0] == 0) vtErase(vt, start + vt->x, start + vt->cols);
+      else if (params[0] == 1) vtErase(vt, start, start + vt->x + 1);
+      else vtErase(vt, start, start + vt->cols);
+      return;
+    }
+    case 'b':
+      while (n--) vtPutGlyph(vt, vt->last);
+      return;
+    case 'm':
+      return;
+    default:
+      vtError(vt, "unsupported CSI '%c'", final);
+      return;
+  }
 
-  initTerminal();
+  /* Cursor motions clamp at the edges and cancel a pending wrap. */
+  if (vt->y < 0) vt->y = 0;
+  if (vt->y >= vt->rows) vt->y = vt->rows - 1;
+  if (vt->x < 0) vt->x = 0;
+  if (vt->x >= vt->cols) vt->x = vt->cols - 1;
+  vt->wrap_pending = 0;
+}
 
-  unsigned char *net_buffer = malloc(65536); // Max 255*255 + safety
-  unsigned char *recv_buffer = malloc(132000); // 2 * max frame + safety
-  int recv_len = 0;
+/* Apply the bytes written to the terminal to the model. */
+void vtFeed(vtModel *vt, const unsigned char *buf, int len) {
+  vt->bytes += len;
+  for (int i = 0; i < len; i++) {
+    unsigned char c = buf[i];
 
-  // State: Peer's last frame for redraws
-  unsigned char *last_peer_pixels = malloc(65536);
-  int last_peer_w = 0, last_peer_h = 0;
+    if (vt->seqlen > 0) {
+      if (vt->seqlen == sizeof(vt->seq)) {
+        vtError(vt, "escape sequence too long");
+        vt->seqlen = 0;
+        continue;
+      }
+      vt->seq[vt->seqlen++] = c;
+      if (vt->seqlen == 2 && c != '[') {
+        vtError(vt, "unsupported escape sequence ESC %c", c);
+        vt->seqlen = 0;
+      } else if (vt->seqlen > 2 && c >= 0x40 && c <= 0x7e) {
+        vtExecCSI(vt);
+        vt->seqlen = 0;
+      }
+    } else if (vt->utf8need > 0) {
+      vt->utf8[vt->utf8len++] = c;
+      if (vt->utf8len == vt->utf8need) {
+        vtPutGlyph(vt, vtPackGlyph(vt->utf8, vt->utf8len));
+        vt->utf8len = vt->utf8need = 0;
+      }
+    } else if (c == ESC) {
+      vt->seq[0] = c;
+      vt->seqlen = 1;
+      vt->escapes++;
+    } else if (c == '\r') {
+      vt->x = 0;
+      vt->wrap_pending = 0;
+    } else if (c == '\n') {
+      vtLineFeed(vt);
+      vt->wrap_pending = 0;
+    } else if (c < 0x20 || c == 0x7f) {
+      vtError(vt, "unsupported control character 0x%02x", c);
+    } else if (get_utf8_char_len(c) > 1) {
+      vt->utf8[0] = c;
+      vt->utf8len = 1;
+      vt->utf8need = get_utf8_char_len(c);
+    } else {
+      vtPutGlyph(vt, c);
+    }
+  }
+}
 
-  // State: Resolution I want to receive (My Terminal)
-  int my_w = E.screencols;
-  int my_h = E.screenrows;
-  if (my_w > 255) my_w = 255;
-  if (my_h > 255) my_h = 255;
+/* Check that the model shows what the grid wants, ignoring CELL_UNKNOWN
+ * cells. Returns 0 if it does, -1 and sets the error otherwise. */
+int vtCompare(vtModel *vt, cellGrid *want) {
+  for (int y = 0; y < want->rows && y < vt->rows; y++) {
+    for (int x = 0; x < want->cols && x < vt->cols; x++) {
+      unsigned char idx = want->cells[y * want->cols + x];
+      if (idx == CELL_UNKNOWN) continue;
+      char *glyph = E.density_glyphs[idx];
+      unsigned int g = vtPackGlyph((unsigned char*)glyph, strlen(glyph));
+      if (vt->cells[y * vt->cols + x] != g) {
+        vtError(vt, "cell %d,%d shows the wrong glyph", y + 1, x + 1);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
 
-  // State: Resolution Peer wants to receive (Their Terminal)
-  // Default to 80x60 until we hear otherwise
-  int peer_w = 80;
-  int peer_h = 60;
+/* Draw frame 'f' of a synthetic scene into the grid, as glyph indexes. */
+void vtSelftestScene(cellGrid *g, int scene, int f, unsigned int *seed) {
+  int glyphs = E.density_count, n = g->rows * g->cols;
+  for (int y = 0; y < g->rows; y++) {
+    for (int x = 0; x < g->cols; x++) {
+      unsigned char *cell = g->cells + y * g->cols + x;
+      if (scene == 0) {
+        /* Gradient scrolling sideways: every cell changes, in runs. */
+        *cell = (x + f) * glyphs / (g->cols + 1) % glyphs;
+      } else if (scene == 1) {
+        /* A box bouncing on a flat background: small moving diffs. */
+        int bx = f % (2 * g->cols), by = f % (2 * g->rows);
+        if (bx >= g->cols) bx = 2 * g->cols - 1 - bx;
+        if (by >= g->rows) by = 2 * g->rows - 1 - by;
+        int inside = x >= bx && x < bx + 1 + g->cols / 4 &&
+                     y >= by && y < by + 1 + g->rows / 3;
+        *cell = inside ? glyphs - 1 : 0;
+      } else if (scene == 3 || *cell == CELL_UNKNOWN) {
+        /* Noise: nothing to reuse. */
+        *cell = rand_r(seed) % glyphs;
+      }
+    }
+  }
+  /* Scattered cells: the cursor motions have to take every shortcut. */
+  if (scene == 2) {
+    for (int i = 0; i < n / 50 + 1; i++)
+      g->cells[rand_r(seed) % n] = rand_r(seed) % glyphs;
+  }
+}
+
+/* --vt-selftest: what --vt-check does during a call, without a peer or a
+ * camera. Synthetic scenes are drawn through gridEmit() into the virtual
+ * terminal at a few screen sizes, and every update is verified. Returns
+ * the number of failed runs. */
+int vtSelftest(void) {
+  const char *scenes[] = {"gradient", "bounce", "sparse", "noise"};
+  const int sizes[][2] = {{24, 80}, {50, 200}, {5, 7}, {1, 1}};
+  const int frames = 200;
+  unsigned int seed = 1;
+  int failed = 0;
+
+  for (int i = 0; i < 4; i++) {
+    for (int scene = 0; scene < 4; scene++) {
+      int rows = sizes[i][0], cols = sizes[i][1], f;
+      cellGrid back = {0, 0, NULL}, front = {0, 0, NULL};
+      gridResize(&back, rows, cols);
+      gridResize(&front, rows, cols);
+      vtModel vt;
+      memset(&vt, 0, sizeof(vt));
+      vtInit(&vt, rows + 1, cols); /* Plus the status line. */
+      struct abuf ab = ABUF_INIT;
+
+      for (f = 0; f < frames && !vt.error[0]; f++) {
+        vtSelftestScene(&back, scene, f, &seed);
+        abReset(&ab, 0);
+        gridEmit(&ab, &back, &front);
+        vtFeed(&vt, (unsigned char *)ab.b, ab.len);
+        vt.updates++;
+        if (ab.len > vt.max_bytes) vt.max_bytes = ab.len;
+        vtCompare(&vt, &back);
+      }
+
+      printf("vt-selftest: %-8s %3dx%-3d ", scenes[scene], cols, rows);
+      if (vt.error[0]) {
+        printf("FAILED at frame %d: %s\n", f, vt.error);
+        failed++;
+      } else {
+        printf("OK, %lld bytes/frame (max %lld), %lld escapes/frame\n",
+            vt.bytes / vt.updates, vt.max_bytes, vt.escapes / vt.updates);
+      }
+      abFree(&ab);
+      gridFree(&back);
+      gridFree(&front);
+      vtFree(&vt);
+    }
+  }
+  printf("vt-selftest: %s\n", failed ? "FAILED" : "OK");
+  return failed;
+}
+
+/* --- SPSC RINGS ----------------------------------------------------------- */
+
+/* The network mode is a pipeline of stages, each one on its own thread:
+ *
+ *   capture -> convert -> send          (what we show to the peer)
+ *   receive -> compose -> tty write     (what the peer shows to us)
+ *
+ * Stages talk through bounded single-producer/single-consumer rings of
+ * preallocated slots, so a frame can be converted while the previous one is
+ * still being sent, and the one before that is still being written to the
+ * terminal: per-frame latency is bounded by the slowest stage, not by the
+ * sum of all of them.
+ *
+ * Rings are "latest wins": consumers skip to the newest published slot and
+ * producers drop their item when every slot is busy, so a slow stage never
+ * accumulates a backlog of stale frames. Every ring also has a self-pipe
+ * the producer pokes after publishing, so that consumers can sleep in
+ * select() like the rest of the program does. */
+
+typedef struct {
+  int width;          /* Geometry of the payload, if it is a picture. */
+  int height;
+  int y;              /* First row and number of rows carried, when the */
+  int rows;           /* payload is a slice of a picture. */
+  int hide_x;         /* Columns left out of every row of the slice, */
+  int hide_w;         /* because the receiver can't see them. */
+  int min, max;       /* Darkest and brightest pixel of a whole picture. */
+  long long time;     /* When the camera frame it comes from was taken. */
+  int critical;       /* The frame must reach the peer, even if late. */
+  unsigned int frame; /* Number of the frame a slice belongs to. */
+  int len;            /* Used bytes in 'data'. */
+  int cap;            /* Allocated bytes in 'data'. */
+  unsigned char *data;
+} ringSlot;
+
+typedef struct {
+  ringSlot *slots;
+  unsigned int size;  /* Number of slots, a power of two. */
+  atomic_uint head;   /* Slots published so far. Written by the producer. */
+  atomic_uint tail;   /* Slots consumed so far. Written by the consumer. */
+  int wakefd[2];      /* Self-pipe, the consumer select()s on wakefd[0]. */
+} spscRing;
+
+void ringInit(spscRing *r, unsigned int size) {
+  r->slots = calloc(size, sizeof(ringSlot));
+  r->size = size;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  if (pipe(r->wakefd) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  fcntl(r->wakefd[0], F_SETFL, O_NONBLOCK);
+  fcntl(r->wakefd[1], F_SETFL, O_NONBLOCK);
+}
+
+void ringFree(spscRing *r) {
+  for (unsigned int i = 0; i < r->size; i++) free(r->slots[i].data);
+  free(r->slots);
+  close(r->wakefd[0]);
+  close(r->wakefd[1]);
+}
+
+/* Make sure the slot can hold 'len' bytes. Only the stage owning the slot
+ * may call this, that is the producer between ringAcquire() and
+ * ringPublish(). Returns 0 on out of memory. */
+int ringSlotFit(ringSlot *s, int len) {
+  if (s->cap >= len) return 1;
+  unsigned char *data = realloc(s->data, len);
+  if (data == NULL) return 0;
+  s->data = data;
+  s->cap = len;
+  return 1;
+}
+
+/* Wake up the consumer without publishing anything. */
+void ringWake(spscRing *r) {
+  char c = 0;
+  if (write(r->wakefd[1], &c, 1) == -1) {
+    /* Pipe full: the consumer has plenty of wakeups pending already. */
+  }
+}
+
+/* Producer side: return the slot to fill next, or NULL if the ring is full,
+ * in which case the item should just be dropped. */
+ringSlot *ringAcquire(spscRing *r) {
+  unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (head - tail == r->size) return NULL;
+  return &r->slots[head & (r->size-1)];
+}
+
+/* Producer side: number of slots that can be acquired right now. Producers
+ * of multi-slot items, like the slices of a frame, use this to drop the
+ * whole item rather than a part of it. */
+unsigned int ringSpace(spscRing *r) {
+  unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  return r->size - (head - tail);
+}
+
+/* Producer side: make the slot returned by ringAcquire() visible. */
+void ringPublish(spscRing *r) {
+  unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  ringWake(r);
+}
+
+/* Consumer side: return the oldest published slot, or NULL if empty. */
+ringSlot *ringPeek(spscRing *r) {
+  unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (head == tail) return NULL;
+  return &r->slots[tail & (r->size-1)];
+}
+
+/* Consumer side: discard everything but the newest published slot and
+ * return it, or NULL if empty. */
+ringSlot *ringPeekLatest(spscRing *r) {
+  unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (head == tail) return NULL;
+  if (head - tail > 1) {
+    tail = head - 1;
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+  }
+  return &r->slots[tail & (r->size-1)];
+}
+
+/* Consumer side: give back the slot returned by ringPeek*(). */
+void ringRelease(spscRing *r) {
+  unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+/* Sleep until one of the rings is poked or 'timeout_ms' elapses. Callers
+ * must check their rings *before* waiting, so that a wakeup that arrives in
+ * between is never lost: the byte stays in the pipe and select() returns
+ * immediately. */
+void ringWait(spscRing **rings, int count, int timeout_ms) {
+  fd_set readfds;
+  int maxfd = -1;
+  FD_ZERO(&readfds);
+  for (int i = 0; i < count; i++) {
+    FD_SET(rings[i]->wakefd[0], &readfds);
+    if (rings[i]->wakefd[0] > maxfd) maxfd = rings[i]->wakefd[0];
+  }
+
+  struct timeval tv;
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  if (select(maxfd + 1, &readfds, NULL, NULL, &tv) <= 0) return;
+
+  char buf[64];
+  for (int i = 0; i < count; i++) {
+    if (FD_ISSET(rings[i]->wakefd[0], &readfds))
+      while (read(rings[i]->wakefd[0], buf, sizeof(buf)) > 0);
+  }
+}
+
+/* --- FILTER CHAIN ---------------------------------------------------------
+ * Between the camera and the quantization to glyphs, pictures go through a
+ * chain of stages. The first one downscales camera rows to grayscale, and
+ * the others are row kernels working on the result in place. Instead of
+ * walking the whole picture once per stage, a block of rows small enough
+ * to stay in cache goes through all the stages before the next block is
+ * produced, so adding a stage doesn't add a pass over memory. */
+
+#define FILTER_BLOCK_BYTES 16384
+#define FILTER_MAX_STAGES 8
+
+/* Process n rows, starting with row y of the picture. Rows are 'stride'
+ * bytes apart, since the hidden columns of a slice are left out. */
+typedef struct filterStage {
+  void (*kernel)(struct filterStage *st, unsigned char *rows, int stride,
+                 int y, int n);
+  void *state;
+} filterStage;
+
+typedef struct {
+  frame *in;        /* Camera frame the rows are taken from. */
+  rect src;         /* Part of it that is converted, the whole by default. */
+  int w, h;         /* Size of the picture it is converted to. */
+  filterStage stages[FILTER_MAX_STAGES];
+  int count;
+} filterChain;
+
+/* Downscale the part 'r' of the area 'src' of a BGRA camera frame, seen as
+ * a w*h picture, to grayscale. The converted pixels are stored packed at
+ * 'out'. Cropping is just a matter of where pixels are sampled. */
+void resizeAndGrayRect(frame *in, rect src, unsigned char *out, int w, int h,
+                       rect r) {
+  for (int y = r.y; y < r.y + r.h; y++) {
+    int iy = src.y + (y * src.h) / h;
+    for (int x = r.x; x < r.x + r.w; x++) {
+      int ix = src.x + (x * src.w) / w;
+      int offset = (iy * in->width + ix) * 4;
+
+      unsigned char b = in->pixels[offset + 0];
+      unsigned char g = in->pixels[offset + 1];
+      unsigned char r = in->pixels[offset + 2];
+
+      *out++ = (r*77 + g*150 + b*29) >> 8;
+    }
+  }
+}
+
+void filterChainInit(filterChain *fc, frame *in, int w, int h) {
+  fc->in = in;
+  fc->src = (rect){0, 0, in->width, in->height};
+  fc->w = w;
+  fc->h = h;
+  fc->count = 0;
+}
+
+void filterChainAdd(filterChain *fc,
+    void (*kernel)(filterStage *, unsigned char *, int, int, int),
+    void *state) {
+  if (fc->count == FILTER_MAX_STAGES) return;
+  fc->stages[fc->count].kernel = kernel;
+  fc->stages[fc->count].state = state;
+  fc->count++;
+}
+
+/* Produce rows y..y+n-1 of the picture into 'out', leaving out the hide_w
+ * columns starting at hide_x, and run them through every stage. */
+void filterChainRun(filterChain *fc, unsigned char *out, int y, int n,
+                    int hide_x, int hide_w) {
+  int stride = fc->w - hide_w;
+  if (stride <= 0) return;
+  int block = FILTER_BLOCK_BYTES / stride;
+  if (block < 1) block = 1;
+
+  for (int by = y; by < y + n; by += block) {
+    int bn = (by + block > y + n) ? y + n - by : block;
+    unsigned char *rows = out + (by - y) * stride;
+    if (hide_w == 0) {
+      resizeAndGrayRect(fc->in, fc->src, rows, fc->w, fc->h,
+          (rect){0, by, fc->w, bn});
+    } else {
+      int right = hide_x + hide_w;
+      unsigned char *dst = rows;
+      for (int row = by; row < by + bn; row++) {
+        resizeAndGrayRect(fc->in, fc->src, dst, fc->w, fc->h,
+            (rect){0, row, hide_x, 1});
+        dst += hide_x;
+        resizeAndGrayRect(fc->in, fc->src, dst, fc->w, fc->h,
+            (rect){right, row, fc->w - right, 1});
+        dst += fc->w - right;
+      }
+    }
+    for (int i = 0; i < fc->count; i++)
+      fc->stages[i].kernel(&fc->stages[i], rows, stride, by, bn);
+  }
+}
+
+/* Range stage: collect the darkest and brightest pixel. 'state' points to
+ * an int[2] {min, max}, to be set to {255, 0} before the run. */
+void rangeKernel(filterStage *st, unsigned char *rows, int stride,
+                 int y, int n) {
+  (void)y;
+  int *range = st->state;
+  int lo = range[0], hi = range[1];
+  for (int i = 0; i < stride * n; i++) {
+    if (rows[i] < lo) lo = rows[i];
+    if (rows[i] > hi) hi = rows[i];
+  }
+  range[0] = lo;
+  range[1] = hi;
+}
+
+/* --- CRYPTO ---------------------------------------------------------------
+ * Our own ChaCha20-Poly1305 (RFC 8439) and X25519 (RFC 7748), so that calls
+ * can be encrypted with --encrypt without depending on any library.
+ *
+ * The keystream is generated four ChaCha20 blocks at a time: with SSE2 the
+ * four blocks are computed in parallel, one per 32-bit lane, and without it
+ * the same loop runs one block after the other. */
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d) do { \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7); \
+  } while (0)
+
+#define CHACHA_STREAM_BYTES 256 /* Four blocks. */
+
+uint32_t load32le(const unsigned char *p) {
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+void store32le(unsigned char *p, uint32_t v) {
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+typedef struct {
+  uint32_t state[16];  /* Constants, key, block counter, nonce. */
+  unsigned char stream[CHACHA_STREAM_BYTES];
+  int used;            /* Bytes of 'stream' already consumed. */
+} chachaStream;
+
+void chachaInit(chachaStream *cs, const unsigned char key[32],
+                uint32_t counter, const unsigned char nonce[12]) {
+  cs->state[0] = 0x61707865;
+  cs->state[1] = 0x3320646e;
+  cs->state[2] = 0x79622d32;
+  cs->state[3] = 0x6b206574;
+  for (int i = 0; i < 8; i++) cs->state[4+i] = load32le(key + 4*i);
+  cs->state[12] = counter;
+  for (int i = 0; i < 3; i++) cs->state[13+i] = load32le(nonce + 4*i);
+  cs->used = CHACHA_STREAM_BYTES;
+}
+
+void chachaRounds(uint32_t x[16]) {
+  for (int i = 0; i < 10; i++) {
+    CHACHA_QR(x[0], x[4], x[8],  x[12]);
+    CHACHA_QR(x[1], x[5], x[9],  x[13]);
+    CHACHA_QR(x[2], x[6], x[10], x[14]);
+    CHACHA_QR(x[3], x[7], x[11], x[15]);
+    CHACHA_QR(x[0], x[5], x[10], x[15]);
+    CHACHA_QR(x[1], x[6], x[11], x[12]);
+    CHACHA_QR(x[2], x[7], x[8],  x[13]);
+    CHACHA_QR(x[3], x[4], x[9],  x[14]);
+  }
+}
+
+#ifdef __SSE2__
+#define ROTL128(v, n) \
+  _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define CHACHA_QR128(a, b, c, d) do { \
+    a = _mm_add_epi32(a, b); d = ROTL128(_mm_xor_si128(d, a), 16); \
+    c = _mm_add_epi32(c, d); b = ROTL128(_mm_xor_si128(b, c), 12); \
+    a = _mm_add_epi32(a, b); d = ROTL128(_mm_xor_si128(d, a), 8); \
+    c = _mm_add_epi32(c, d); b = ROTL128(_mm_xor_si128(b, c), 7); \
+  } while (0)
+
+/* Four blocks at once: x[i] holds word i of the four blocks. */
+void chachaRefill(chachaStream *cs) {
+  __m128i x[16], in[16];
+  for (int i = 0; i < 16; i++) in[i] = _mm_set1_epi32(cs->state[i]);
+  in[12] = _mm_add_epi32(in[12], _mm_set_epi32(3, 2, 1, 0));
+  memcpy(x, in, sizeof(x));
+  for (int i = 0; i < 10; i++) {
+    CHACHA_QR128(x[0], x[4], x[8],  x[12]);
+    CHACHA_QR128(x[1], x[5], x[9],  x[13]);
+    CHACHA_QR128(x[2], x[6], x[10], x[14]);
+    CHACHA_QR128(x[3], x[7], x[11], x[15]);
+    CHACHA_QR128(x[0], x[5], x[10], x[15]);
+    CHACHA_QR128(x[1], x[6], x[11], x[12]);
+    CHACHA_QR128(x[2], x[7], x[8],  x[13]);
+    CHACHA_QR128(x[3], x[4], x[9],  x[14]);
+  }
+  /* Transpose four words at a time back into block order. */
+  for (int i = 0; i < 16; i += 4) {
+    __m128i a = _mm_add_epi32(x[i], in[i]);
+    __m128i b = _mm_add_epi32(x[i+1], in[i+1]);
+    __m128i c = _mm_add_epi32(x[i+2], in[i+2]);
+    __m128i d = _mm_add_epi32(x[i+3], in[i+3]);
+    __m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(c, d);
+    __m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(c, d);
+    unsigned char *out = cs->stream + 4*i;
+    _mm_storeu_si128((__m128i *)(out),       _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(out + 64),  _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(out + 128), _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i *)(out + 192), _mm_unpackhi_epi64(t2, t3));
+  }
+  cs->state[12] += 4;
+  cs->used = 0;
+}
+#else
+void chachaRefill(chachaStream *cs) {
+  for (int b = 0; b < CHACHA_STREAM_BYTES / 64; b++) {
+    uint32_t x[16];
+    memcpy(x, cs->state, sizeof(x));
+    chachaRounds(x);
+    for (int i = 0; i < 16; i++)
+      store32le(cs->stream + 64*b + 4*i, x[i] + cs->state[i]);
+    cs->state[12]++;
+  }
+  cs->used = 0;
+}
+#endif
+
+/* XOR 'len' bytes of keystream into src, writing to dst (may be src). */
+void chachaXor(chachaStream *cs, unsigned char *dst, const unsigned char *src,
+               int len) {
+  while (len > 0) {
+    if (cs->used == CHACHA_STREAM_BYTES) chachaRefill(cs);
+    int n = CHACHA_STREAM_BYTES - cs->used;
+    if (n > len) n = len;
+    const unsigned char *ks = cs->stream + cs->used;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+      uint64_t a, k;
+      memcpy(&a, src + i, 8);
+      memcpy(&k, ks + i, 8);
+      a ^= k;
+      memcpy(dst + i, &a, 8);
+    }
+    for (; i < n; i++) dst[i] = src[i] ^ ks[i];
+    cs->used += n;
+    dst += n;
+    src += n;
+    len -= n;
+  }
+}
+
+/* HChaCha20: turns a shared secret into a uniformly random key. */
+void hchacha20(unsigned char out[32], const unsigned char key[32],
+               const unsigned char nonce[16]) {
+  chachaStream cs;
+  unsigned char n12[12] = {0};
+  chachaInit(&cs, key, 0, n12);
+  for (int i = 0; i < 4; i++) cs.state[12+i] = load32le(nonce + 4*i);
+  chachaRounds(cs.state);
+  for (int i = 0; i < 4; i++) {
+    store32le(out + 4*i, cs.state[i]);
+    store32le(out + 16 + 4*i, cs.state[12+i]);
+  }
+}
+
+/* Poly1305 with 26 bit limbs, as in poly1305-donna. */
+typedef struct {
+  uint32_t r[5], h[5], pad[4];
+  unsigned char buf[16];
+  int buflen;
+} poly1305;
+
+void poly1305Init(poly1305 *st, const unsigned char key[32]) {
+  st->r[0] = load32le(key + 0) & 0x3ffffff;
+  st->r[1] = (load32le(key + 3) >> 2) & 0x3ffff03;
+  st->r[2] = (load32le(key + 6) >> 4) & 0x3ffc0ff;
+  st->r[3] = (load32le(key + 9) >> 6) & 0x3f03fff;
+  st->r[4] = (load32le(key + 12) >> 8) & 0x00fffff;
+  for (int i = 0; i < 5; i++) st->h[i] = 0;
+  for (int i = 0; i < 4; i++) st->pad[i] = load32le(key + 16 + 4*i);
+  st->buflen = 0;
+}
+
+void poly1305Blocks(poly1305 *st, const unsigned char *m, int len,
+                    uint32_t hibit) {
+  uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3],
+           r4 = st->r[4];
+  uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+  uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3],
+           h4 = st->h[4];
+
+  for (; len >= 16; m += 16, len -= 16) {
+    h0 += load32le(m + 0) & 0x3ffffff;
+    h1 += (load32le(m + 3) >> 2) & 0x3ffffff;
+    h2 += (load32le(m + 6) >> 4) & 0x3ffffff;
+    h3 += (load32le(m + 9) >> 6) & 0x3ffffff;
+    h4 += (load32le(m + 12) >> 8) | hibit;
+
+    uint64_t d0 = (uint64_t)h0*r0 + (uint64_t)h1*s4 + (uint64_t)h2*s3 +
+                  (uint64_t)h3*s2 + (uint64_t)h4*s1;
+    uint64_t d1 = (uint64_t)h0*r1 + (uint64_t)h1*r0 + (uint64_t)h2*s4 +
+                  (uint64_t)h3*s3 + (uint64_t)h4*s2;
+    uint64_t d2 = (uint64_t)h0*r2 + (uint64_t)h1*r1 + (uint64_t)h2*r0 +
+                  (uint64_t)h3*s4 + (uint64_t)h4*s3;
+    uint64_t d3 = (uint64_t)h0*r3 + (uint64_t)h1*r2 + (uint64_t)h2*r1 +
+                  (uint64_t)h3*r0 + (uint64_t)h4*s4;
+    uint64_t d4 = (uint64_t)h0*r4 + (uint64_t)h1*r3 + (uint64_t)h2*r2 +
+                  (uint64_t)h3*r1 + (uint64_t)h4*r0;
+
+    uint32_t c;
+    c = d0 >> 26; h0 = d0 & 0x3ffffff; d1 += c;
+    c = d1 >> 26; h1 = d1 & 0x3ffffff; d2 += c;
+    c = d2 >> 26; h2 = d2 & 0x3ffffff; d3 += c;
+    c = d3 >> 26; h3 = d3 & 0x3ffffff; d4 += c;
+    c = d4 >> 26; h4 = d4 & 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+  }
+  st->h[0] = h0; st->h[1] = h1; st->h[2] = h2; st->h[3] = h3; st->h[4] = h4;
+}
+
+void poly1305Update(poly1305 *st, const unsigned char *m, int len) {
+  if (st->buflen) {
+    int n = 16 - st->buflen;
+    if (n > len) n = len;
+    memcpy(st->buf + st->buflen, m, n);
+    st->buflen += n;
+    m += n;
+    len -= n;
+    if (st->buflen < 16) return;
+    poly1305Blocks(st, st->buf, 16, 1 << 24);
+    st->buflen = 0;
+  }
+  int full = len & ~15;
+  poly1305Blocks(st, m, full, 1 << 24);
+  memcpy(st->buf, m + full, len - full);
+  st->buflen = len - full;
+}
+
+void poly1305Finish(poly1305 *st, unsigned char mac[16]) {
+  if (st->buflen) {
+    st->buf[st->buflen] = 1;
+    memset(st->buf + st->buflen + 1, 0, 15 - st->buflen);
+    poly1305Blocks(st, st->buf, 16, 0);
+  }
+
+  uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3],
+           h4 = st->h[4], c;
+  c = h1 >> 26; h1 &= 0x3ffffff; h2 += c;
+  c = h2 >> 26; h2 &= 0x3ffffff; h3 += c;
+  c = h3 >> 26; h3 &= 0x3ffffff; h4 += c;
+  c = h4 >> 26; h4 &= 0x3ffffff; h0 += c * 5;
+  c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+
+  /* h - p, and pick it if it didn't go negative. */
+  uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+  uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+  uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+  uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+  uint32_t g4 = h4 + c - (1 << 26);
+  uint32_t mask = (g4 >> 31) - 1;
+  h0 = (h0 & ~mask) | (g0 & mask);
+  h1 = (h1 & ~mask) | (g1 & mask);
+  h2 = (h2 & ~mask) | (g2 & mask);
+  h3 = (h3 & ~mask) | (g3 & mask);
+  h4 = (h4 & ~mask) | (g4 & mask);
+
+  /* h + pad, mod 2^128. */
+  uint64_t f;
+  f = (uint64_t)(h0 | (h1 << 26)) + st->pad[0];
+  store32le(mac, f);
+  f = (uint64_t)((h1 >> 6) | (h2 << 20)) + st->pad[1] + (f >> 32);
+  store32le(mac + 4, f);
+  f = (uint64_t)((h2 >> 12) | (h3 << 14)) + st->pad[2] + (f >> 32);
+  store32le(mac + 8, f);
+  f = (uint64_t)((h3 >> 18) | (h4 << 8)) + st->pad[3] + (f >> 32);
+  store32le(mac + 12, f);
+}
+
+/* ChaCha20-Poly1305 AEAD, usable a piece at a time, so that a packet
+ * header and its payload can be sealed in place without joining them. */
+typedef struct {
+  chachaStream cs;
+  poly1305 mac;
+  uint64_t aad_len, text_len;
+} aead;
+
+void aeadBegin(aead *a, const unsigned char key[32], uint64_t seq,
+               const unsigned char *aad, int aad_len) {
+  static const unsigned char zeros[16];
+  unsigned char nonce[12] = {0}, poly_key[64];
+  for (int i = 0; i < 8; i++) nonce[4+i] = seq >> (8*i);
+  chachaInit(&a->cs, key, 0, nonce);
+  chachaXor(&a->cs, poly_key, zeros, 16);
+  chachaXor(&a->cs, poly_key + 16, zeros, 16);
+  poly1305Init(&a->mac, poly_key);
+  /* The text starts with block 1: skip the rest of block 0. */
+  a->cs.used += 32;
+  poly1305Update(&a->mac, aad, aad_len);
+  poly1305Update(&a->mac, zeros, (16 - aad_len % 16) % 16);
+  a->aad_len = aad_len;
+  a->text_len = 0;
+}
+
+void aeadEncrypt(aead *a, unsigned char *buf, int len) {
+  chachaXor(&a->cs, buf, buf, len);
+  poly1305Update(&a->mac, buf, len);
+  a->text_len += len;
+}
+
+/* Authenticate ciphertext: decrypt it only after aeadVerify() succeeds. */
+void aeadAuthenticate(aead *a, const unsigned char *buf, int len) {
+  poly1305Update(&a->mac, buf, len);
+  a->text_len += len;
+}
+
+void aeadFinish(aead *a, unsigned char tag[16]) {
+  static const unsigned char zeros[16];
+  unsigned char lens[16];
+  poly1305Update(&a->mac, zeros, (16 - a->text_len % 16) % 16);
+  for (int i = 0; i < 8; i++) {
+    lens[i] = a->aad_len >> (8*i);
+    lens[8+i] = a->text_len >> (8*i);
+  }
+  poly1305Update(&a->mac, lens, 16);
+  poly1305Finish(&a->mac, tag);
+}
+
+/* Constant time tag check. */
+int aeadVerify(aead *a, const unsigned char tag[16]) {
+  unsigned char mine[16], diff = 0;
+  aeadFinish(a, mine);
+  for (int i = 0; i < 16; i++) diff |= mine[i] ^ tag[i];
+  return diff == 0;
+}
+
+/* X25519, with field elements as 16 limbs of 16 bits (as in TweetNaCl). */
+typedef int64_t gf[16];
+
+void gfCarry(gf o) {
+  for (int i = 0; i < 16; i++) {
+    int64_t c = o[i] >> 16;
+    o[i] -= c * 65536;
+    if (i < 15) o[i+1] += c;
+    else o[0] += 38 * c; /* 2^256 = 38 mod 2^255-19 */
+  }
+}
+
+/* Swap p and q if b is 1, without branching on it. */
+void gfSwap(gf p, gf q, int b) {
+  int64_t mask = ~((int64_t)b - 1);
+  for (int i = 0; i < 16; i++) {
+    int64_t t = mask & (p[i] ^ q[i]);
+    p[i] ^= t;
+    q[i] ^= t;
+  }
+}
+
+void gfAdd(gf o, const gf a, const gf b) {
+  for (int i = 0; i < 16; i++) o[i] = a[i] + b[i];
+}
+
+void gfSub(gf o, const gf a, const gf b) {
+  for (int i = 0; i < 16; i++) o[i] = a[i] - b[i];
+}
+
+void gfMul(gf o, const gf a, const gf b) {
+  int64_t t[31] = {0};
+  for (int i = 0; i < 16; i++)
+    for (int j = 0; j < 16; j++) t[i+j] += a[i] * b[j];
+  for (int i = 0; i < 15; i++) t[i] += 38 * t[i+16];
+  for (int i = 0; i < 16; i++) o[i] = t[i];
+  gfCarry(o);
+  gfCarry(o);
+}
+
+void gfInvert(gf o, const gf in) {
+  gf c;
+  memcpy(c, in, sizeof(gf));
+  for (int a = 253; a >= 0; a--) { /* in^(p-2) */
+    gfMul(c, c, c);
+    if (a != 2 && a != 4) gfMul(c, c, in);
+  }
+  memcpy(o, c, sizeof(gf));
+}
+
+void gfPack(unsigned char out[32], const gf n) {
+  gf t, m;
+  memcpy(t, n, sizeof(gf));
+  gfCarry(t);
+  gfCarry(t);
+  gfCarry(t);
+  for (int j = 0; j < 2; j++) { /* Subtract p if t >= p. */
+    m[0] = t[0] - 0xffed;
+    for (int i = 1; i < 15; i++) {
+      m[i] = t[i] - 0xffff - ((m[i-1] >> 16) & 1);
+      m[i-1] &= 0xffff;
+    }
+    m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+    int b = (m[15] >> 16) & 1;
+    m[14] &= 0xffff;
+    gfSwap(t, m, 1 - b);
+  }
+  for (int i = 0; i < 16; i++) {
+    out[2*i] = t[i] & 0xff;
+    out[2*i+1] = t[i] >> 8;
+  }
+}
+
+void x25519(unsigned char out[32], const unsigned char scalar[32],
+            const unsigned char point[32]) {
+  static const gf a24 = {0xdb41, 1}; /* 121665 */
+  unsigned char z[32];
+  gf x, a, b, c, d, e, f;
+
+  memcpy(z, scalar, 32);
+  z[31] = (z[31] & 127) | 64;
+  z[0] &= 248;
+  for (int i = 0; i < 16; i++) x[i] = point[2*i] | (int64_t)point[2*i+1] << 8;
+  x[15] &= 0x7fff;
+
+  /* Montgomery ladder. */
+  for (int i = 0; i < 16; i++) {
+    b[i] = x[i];
+    a[i] = c[i] = d[i] = 0;
+  }
+  a[0] = d[0] = 1;
+  for (int i = 254; i >= 0; i--) {
+    int bit = (z[i >> 3] >> (i & 7)) & 1;
+    gfSwap(a, b, bit);
+    gfSwap(c, d, bit);
+    gfAdd(e, a, c);
+    gfSub(a, a, c);
+    gfAdd(c, b, d);
+    gfSub(b, b, d);
+    gfMul(d, e, e);
+    gfMul(f, a, a);
+    gfMul(a, c, a);
+    gfMul(c, b, e);
+    gfAdd(e, a, c);
+    gfSub(a, a, c);
+    gfMul(b, a, a);
+    gfSub(c, d, f);
+    gfMul(a, c, a24);
+    gfAdd(a, a, d);
+    gfMul(c, c, a);
+    gfMul(a, d, f);
+    gfMul(d, b, x);
+    gfMul(b, e, e);
+    gfSwap(a, b, bit);
+    gfSwap(c, d, bit);
+  }
+  gfInvert(c, c);
+  gfMul(a, a, c);
+  gfPack(out, a);
+}
+
+void x25519Base(unsigned char pub[32], const unsigned char secret[32]) {
+  static const unsigned char base[32] = {9};
+  x25519(pub, secret, base);
+}
+
+long long microseconds(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* --crypto-bench: what encryption costs compared to the 33 ms we have to
+ * produce a frame, for the largest picture the protocol can carry. */
+void cryptoBench(void) {
+  const int frame_len = 255 * 255, rounds = 2000;
+  unsigned char key[32] = {1}, hdr[2] = {0}, tag[16], secret[32] = {2};
+  unsigned char *buf = calloc(frame_len, 1);
+
+  long long start = microseconds();
+  for (int i = 0; i < 100; i++) x25519Base(secret, secret);
+  double kx_us = (microseconds() - start) / 100.0;
+
+  start = microseconds();
+  for (int i = 0; i < rounds; i++) {
+    aead a;
+    aeadBegin(&a, key, i, hdr, 2);
+    aeadEncrypt(&a, buf, frame_len);
+    aeadFinish(&a, tag);
+  }
+  double seal_us = (double)(microseconds() - start) / rounds;
+  free(buf);
+
+#ifdef __SSE2__
+  const char *impl = "SSE2, 4 blocks in parallel";
+#else
+  const char *impl = "portable C";
+#endif
+  printf("X25519 key exchange:   %.0f us (once per call)\n", kx_us);
+  printf("ChaCha20-Poly1305:     %.0f MB/s (%s)\n",
+      frame_len / seal_us, impl);
+  printf("255x255 frame:         %.1f us, %.2f%% of a 33 ms frame\n",
+      seal_us, seal_us / 330.0);
+  printf("Relayed (open + seal): %.1f us, %.2f%% of a 33 ms frame\n",
+      2 * seal_us, 2 * seal_us / 330.0);
+}
+
+/* --- LZ COMPRESSION ------------------------------------------------------- */
+
+/* An LZ77 compressor in the style of LZ4, for packets that repeat bytes
+ * already sent: a still background is the same as in the last frame. Each
+ * end keeps the last LZ_WINDOW bytes that went through it on a connection,
+ * so matches reach back into earlier packets. A block is a series of
+ *
+ *   token | literal length | literals | offset (2 bytes, LE) | match length
+ *
+ * where the high nibble of the token is the number of literals and the low
+ * one the match length minus LZ_MIN_MATCH. A nibble of 15 is followed by
+ * bytes to add to it, up to the first one below 255. The last sequence of
+ * a block has literals only. */
+#define LZ_WINDOW 65535
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_BLOCK 65536
+#define LZ_HIST_SIZE (LZ_WINDOW + 2 * LZ_MAX_BLOCK)
+#define LZ_HASH_BITS 14
+
+typedef struct {
+  unsigned char *hist; /* Past bytes, then the block being worked on. */
+  int len;
+  int *table;          /* Compressor only: last position of 4 bytes. */
+} lzStream;
+
+void lzReset(lzStream *z) {
+  z->len = 0;
+  if (z->table) {
+    for (int i = 0; i < 1 << LZ_HASH_BITS; i++) z->table[i] = -1;
+  }
+}
+
+void lzInit(lzStream *z, int compressor) {
+  /* Slack for the wide copies of the decompressor. */
+  z->hist = malloc(LZ_HIST_SIZE + 16);
+  z->table = compressor ? malloc(sizeof(int) << LZ_HASH_BITS) : NULL;
+  lzReset(z);
+}
+
+void lzFree(lzStream *z) {
+  free(z->hist);
+  free(z->table);
+}
+
+/* Make room for a whole block after the history, dropping what is out of
+ * the window. Only offsets are sent, so the two ends don't need to do this
+ * at the same time. */
+void lzMakeRoom(lzStream *z) {
+  if (z->len + LZ_MAX_BLOCK <= LZ_HIST_SIZE) return;
+  int shift = z->len - LZ_WINDOW;
+  memmove(z->hist, z->hist + shift, LZ_WINDOW);
+  z->len = LZ_WINDOW;
+  if (z->table) {
+    for (int i = 0; i < 1 << LZ_HASH_BITS; i++)
+      z->table[i] = z->table[i] >= shift ? z->table[i] - shift : -1;
+  }
+}
+
+/* Where the caller puts the next block to compress. */
+unsigned char *lzNextBlock(lzStream *z) {
+  lzMakeRoom(z);
+  return z->hist + z->len;
+}
+
+int lzPutLength(unsigned char *dst, int out, int len) {
+  while (len >= 255) {
+    dst[out++] = 255;
+    len -= 255;
+  }
+  dst[out++] = len;
+  return out;
+}
+
+/* Append a sequence to dst, or return -1 if it could take more than cap. */
+int lzPutSequence(unsigned char *dst, int out, int cap,
+    const unsigned char *lit, int litlen, int offset, int mlen) {
+  if (out + 2 + litlen / 255 + litlen + 3 + mlen / 255 > cap) return -1;
+  int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+  unsigned char *token = dst + out++;
+  *token = (litlen < 15 ? litlen : 15) << 4 | (ml < 15 ? ml : 15);
+  if (litlen >= 15) out = lzPutLength(dst, out, litlen - 15);
+  memcpy(dst + out, lit, litlen);
+  out += litlen;
+  if (mlen) {
+    dst[out++] = offset & 0xff;
+    dst[out++] = offset >> 8;
+    if (ml >= 15) out = lzPutLength(dst, out, ml - 15);
+  }
+  return out;
+}
+
+/* Compress the len bytes written at lzNextBlock() into dst. Returns the
+ * compressed size, or -1 if it wouldn't be smaller than cap: then the
+ * block is forgotten, as if never compressed. After 2^skip bytes without
+ * a match the search takes bigger steps: a lower skip is faster, but
+ * finds fewer matches. */
+int lzCompress(lzStream *z, int len, unsigned char *dst, int cap, int skip) {
+  unsigned char *h = z->hist;
+  int pos = z->len, anchor = pos, end = pos + len, out = 0;
+
+  while (pos + LZ_MIN_MATCH <= end) {
+    uint32_t v;
+    memcpy(&v, h + pos, 4);
+    uint32_t hash = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+    int cand = z->table[hash];
+    z->table[hash] = pos;
+    /* Entries of forgotten blocks may point ahead: skip those too. */
+    if (cand < 0 || cand >= pos || pos - cand > LZ_WINDOW ||
+        memcmp(h + cand, h + pos, 4) != 0)
+    {
+      /* Speed up through bytes that don't compress. */
+      pos += 1 + ((pos - anchor) >> skip);
+      continue;
+    }
+
+    int mlen = LZ_MIN_MATCH;
+    while (pos + mlen + 8 <= end) {
+      uint64_t a, b;
+      memcpy(&a, h + cand + mlen, 8);
+      memcpy(&b, h + pos + mlen, 8);
+      if (a != b) break;
+      mlen += 8;
+    }
+    while (pos + mlen < end && h[cand + mlen] == h[pos + mlen]) mlen++;
+
+    out = lzPutSequence(dst, out, cap, h + anchor, pos - anchor,
+        pos - cand, mlen);
+    if (out == -1) return -1;
+    pos += mlen;
+    anchor = pos;
+  }
+  out = lzPutSequence(dst, out, cap, h + anchor, end - anchor, 0, 0);
+  if (out == -1) return -1;
+  z->len = end;
+  return out;
+}
+
+int lzGetLength(const unsigned char **ip, const unsigned char *iend,
+    int len) {
+  int b;
+  do {
+    if (*ip >= iend) return -1;
+    b = *(*ip)++;
+    len += b;
+  } while (b == 255 && len < LZ_MAX_BLOCK);
+  return len;
+}
+
+/* Decompress a block, appending it to the history, where *out points to
+ * it. Returns its size, or -1 if the block is malformed. */
+int lzDecompress(lzStream *z, const unsigned char *src, int len,
+    unsigned char **out) {
+  lzMakeRoom(z);
+  unsigned char *h = z->hist, *op = h + z->len, *oend = op + LZ_MAX_BLOCK;
+  const unsigned char *ip = src, *iend = src + len;
+
+  while (ip < iend) {
+    int token = *ip++;
+    int litlen = token >> 4;
+    if (litlen == 15 && (litlen = lzGetLength(&ip, iend, litlen)) == -1)
+      return -1;
+    if (litlen > iend - ip || litlen > oend - op) return -1;
+    if (litlen <= 16 && iend - ip >= 16) {
+      memcpy(op, ip, 16); /* Most runs are short: one fixed size copy. */
+    } else {
+      memcpy(op, ip, litlen);
+    }
+    op += litlen;
+    ip += litlen;
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return -1;
+    int offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    int mlen = token & 15;
+    if (mlen == 15 && (mlen = lzGetLength(&ip, iend, mlen)) == -1)
+      return -1;
+    mlen += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op - h || mlen > oend - op) return -1;
+
+    const unsigned char *m = op - offset;
+    if (offset >= 16) {
+      /* May write up to 15 bytes too many, overwritten next. */
+      for (int i = 0; i < mlen; i += 16) memcpy(op + i, m + i, 16);
+    } else if (offset >= 8) {
+      for (int i = 0; i < mlen; i += 8) memcpy(op + i, m + i, 8);
+    } else {
+      for (int i = 0; i < mlen; i++) op[i] = m[i];
+    }
+    op += mlen;
+  }
+
+  *out = h + z->len;
+  int n = op - *out;
+  z->len += n;
+  return n;
+}
+
+/* --lz-bench: compress a stream of the largest frames the protocol can
+ * carry at both search speeds the send stage uses, checking that every
+ * block decompresses to what went in, then feed the decoder corrupted
+ * blocks. Build with -fsanitize=address,undefined to also check that it
+ * never reads or writes out of bounds. Returns -1 on a failure. */
+int lzBench(void) {
+  const int w = 255, h = 255, frames = 300, cap = LZ_MAX_BLOCK + 1024;
+  const char *inputs[] = {"moving gradient", "1 in 8 noise"};
+  unsigned char *blocks = malloc((size_t)frames * cap);
+  int *sizes = malloc(sizeof(int) * frames);
+  unsigned int seed = 1;
+  int failed = 0;
+
+  for (int input = 0; input < 2; input++) {
+    for (int skip = 6; skip >= 3; skip -= 3) {
+      lzStream enc, dec;
+      lzInit(&enc, 1);
+      lzInit(&dec, 0);
+      long long packed = 0, comp_us = 0, decomp_us = 0;
+      for (int f = 0; f < frames; f++) {
+        unsigned char *px = lzNextBlock(&enc);
+        for (int i = 0; i < w * h; i++) {
+          px[i] = (i % w + i / w + 3 * f) & 0xff;
+          if (input == 1 && rand_r(&seed) % 8 == 0) px[i] = rand_r(&seed);
+        }
+        unsigned char *block = blocks + (size_t)f * cap, *out;
+        long long start = microseconds();
+        int n = sizes[f] = lzCompress(&enc, w * h, block, cap, skip);
+        comp_us += microseconds() - start;
+        start = microseconds();
+        int m = lzDecompress(&dec, block, n, &out);
+        decomp_us += microseconds() - start;
+        if (n == -1 || m != w * h || memcmp(out, px, w * h) != 0) {
+          printf("%s: frame %d doesn't survive the round trip\n",
+              inputs[input], f);
+          failed = 1;
+          break;
+        }
+        packed += n;
+      }
+      long long total = (long long)frames * w * h;
+      printf("%-15s skip %d: %4.1f%% of the size, compress %5.0f MB/s, "
+          "decompress %5.0f MB/s\n", inputs[input], skip,
+          100.0 * packed / total, (double)total / (comp_us + 1),
+          (double)total / (decomp_us + 1));
+      lzFree(&enc);
+      lzFree(&dec);
+    }
+  }
+
+  /* Blocks of the last run with a few bytes changed, or cut short. */
+  const int rounds = 20000;
+  int rejected = 0;
+  unsigned char *bad = malloc(cap);
+  lzStream dec;
+  lzInit(&dec, 0);
+  for (int i = 0; i < rounds && !failed; i++) {
+    int f = rand_r(&seed) % frames, len = sizes[f];
+    memcpy(bad, blocks + (size_t)f * cap, len);
+    for (int k = rand_r(&seed) % 4; k >= 0; k--)
+      bad[rand_r(&seed) % len] = rand_r(&seed);
+    if (rand_r(&seed) % 4 == 0) len = rand_r(&seed) % len + 1;
+    unsigned char *out;
+    int n = lzDecompress(&dec, bad, len, &out);
+    if (n == -1) rejected++;
+    else if (n > LZ_MAX_BLOCK) failed = 1;
+  }
+  printf("Corrupted blocks: %d, %d rejected, the rest decoded within "
+      "bounds: %s\n", rounds, rejected, failed ? "FAILED" : "OK");
+  lzFree(&dec);
+  free(bad);
+  free(blocks);
+  free(sizes);
+  return failed ? -1 : 0;
+}
+
+/* --- NETWORK MODE --------------------------------------------------------- */
+
+long long current_timestamp(void) {
+  struct timeval te;
+  gettimeofday(&te, NULL);
+  long long milliseconds = te.tv_sec*1000LL + te.tv_usec/1000;
+  return milliseconds;
+}
+
+/* Wait for the peer on 'port', over IPv6 or IPv4. The listening socket
+ * is left open in *listen_fd, to accept the peer again if the connection
+ * drops. */
+int tcpListen(int port, int *listen_fd) {
+  int server_fd, new_socket;
+  struct sockaddr_in6 address;
+  int opt = 1, v6only = 0;
+
+  // One socket for both families, unless the system has no IPv6 at all
+  memset(&address, 0, sizeof(address));
+  address.sin6_family = AF_INET6;
+  address.sin6_addr = in6addr_any;
+  address.sin6_port = htons(port);
+  socklen_t addrlen = sizeof(address);
+  if ((server_fd = socket(AF_INET6, SOCK_STREAM, 0)) != -1) {
+    setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only,
+        sizeof(v6only));
+  } else if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) != -1) {
+    struct sockaddr_in *address4 = (struct sockaddr_in *)&address;
+    memset(&address, 0, sizeof(address));
+    address4->sin_family = AF_INET;
+    address4->sin_addr.s_addr = INADDR_ANY;
+    address4->sin_port = htons(port);
+    addrlen = sizeof(*address4);
+  } else {
+    perror("socket failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // Forcefully attach socket to the port
+  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+    perror("setsockopt");
+    exit(EXIT_FAILURE);
+  }
+
+  if (bind(server_fd, (struct sockaddr *)&address, addrlen)<0) {
+    perror("bind failed");
+    exit(EXIT_FAILURE);
+  }
+
+  if (listen(server_fd, 3) < 0) {
+    perror("listen");
+    exit(EXIT_FAILURE);
+  }
+
+  fprintf(stderr, "Waiting for connection on port %d... (Ctrl+C to quit)\n",
+      port);
+
+  // Wait for connection with Ctrl+C support
+  while(1) {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(STDIN_FILENO, &readfds);
+    FD_SET(server_fd, &readfds);
+
+    if (select(server_fd + 1, &readfds, NULL, NULL, NULL) < 0) {
+      if (errno == EINTR) continue;
+      perror("select");
+      exit(EXIT_FAILURE);
+    }
+
+    // Check for Ctrl+C
+    if (FD_ISSET(STDIN_FILENO, &readfds)) {
+      char c;
+      if (read(STDIN_FILENO, &c, 1) == 1) {
+        if (c == CTRL_C) {
+          write(STDOUT_FILENO, "\r\n", 2);
+          exit(0);
+        }
+      }
+    }
+
+    // Check for Incoming Connection
+    if (FD_ISSET(server_fd, &readfds)) {
+      if ((new_socket = accept(server_fd, NULL, NULL)) < 0) {
+        perror("accept");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+  }
+
+  fprintf(stderr, "Connected!\n");
+  *listen_fd = server_fd;
+  return new_socket;
+}
+
+/* Dialing a host name tries each of its addresses in turn, alternating
+ * IPv6 and IPv4, and starts the next attempt if the previous one didn't
+ * complete within DIAL_STAGGER_MS, without giving up on it. The first
+ * connection to complete wins. So a broken family costs a quarter second
+ * instead of a full TCP timeout ("Happy Eyeballs", RFC 8305). */
+#define DIAL_STAGGER_MS 250
+#define DIAL_MAX_ADDRS 8
+
+typedef struct {
+  struct addrinfo *res;
+  struct addrinfo *addrs[DIAL_MAX_ADDRS]; /* In the order we try them. */
+  int naddrs, next;         /* Addresses, and the next one to try. */
+  int fds[DIAL_MAX_ADDRS];  /* Attempts in progress, -1 if over. */
+  long long next_time;      /* When to start the next attempt anyway. */
+  int error;                /* Why the last attempt failed. */
+} tcpDialer;
+
+/* Resolve host:port and get ready to dial it. Returns -1, with a message
+ * in 'err', if the name doesn't resolve. */
+int dialStart(tcpDialer *d, const char *host, int port, char *err,
+    int errlen) {
+  struct addrinfo hints;
+  char service[16];
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  snprintf(service, sizeof(service), "%d", port);
+
+  memset(d, 0, sizeof(*d));
+  int retval = getaddrinfo(host, service, &hints, &d->res);
+  if (retval != 0) {
+    snprintf(err, errlen, "%s", gai_strerror(retval));
+    return -1;
+  }
+
+  /* getaddrinfo() already sorted them by preference: keep that order
+   * within each family, but take turns starting with the preferred one. */
+  struct addrinfo *first = d->res, *other = NULL;
+  for (struct addrinfo *ai = d->res; ai; ai = ai->ai_next) {
+    if (ai->ai_family != d->res->ai_family && other == NULL) other = ai;
+  }
+  while ((first || other) && d->naddrs < DIAL_MAX_ADDRS) {
+    if (first) {
+      d->addrs[d->naddrs++] = first;
+      do first = first->ai_next;
+      while (first && first->ai_family != d->res->ai_family);
+    }
+    if (other && d->naddrs < DIAL_MAX_ADDRS) {
+      d->addrs[d->naddrs++] = other;
+      do other = other->ai_next;
+      while (other && other->ai_family == d->res->ai_family);
+    }
+  }
+  for (int i = 0; i < DIAL_MAX_ADDRS; i++) d->fds[i] = -1;
+  d->error = ECONNREFUSED;
+  return 0;
+}
+
+void dialStop(tcpDialer *d) {
+  for (int i = 0; i < DIAL_MAX_ADDRS; i++) {
+    if (d->fds[i] != -1) close(d->fds[i]);
+    d->fds[i] = -1;
+  }
+  if (d->res) freeaddrinfo(d->res);
+  d->res = NULL;
+}
+
+/* Start the next attempt if it is due, and add the attempts in progress
+ * to 'writefds', shortening *wait_ms to the time of the next one. */
+void dialFdSet(tcpDialer *d, fd_set *writefds, int *maxfd,
+    long long *wait_ms) {
+  int pending = 0;
+  for (int i = 0; i < d->next; i++) pending += d->fds[i] != -1;
+
+  long long now = current_timestamp();
+  while (d->next < d->naddrs && (pending == 0 || now >= d->next_time)) {
+    struct addrinfo *ai = d->addrs[d->next];
+    int sock = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (sock != -1) {
+      fcntl(sock, F_SETFL, O_NONBLOCK);
+      if (connect(sock, ai->ai_addr, ai->ai_addrlen) == -1 &&
+          errno != EINPROGRESS)
+      {
+        d->error = errno;
+        close(sock);
+        sock = -1;
+      }
+    } else {
+      d->error = errno;
+    }
+    d->fds[d->next++] = sock;
+    if (sock != -1) {
+      pending++;
+      d->next_time = now + DIAL_STAGGER_MS;
+    }
+  }
+
+  for (int i = 0; i < d->next; i++) {
+    if (d->fds[i] == -1) continue;
+    FD_SET(d->fds[i], writefds);
+    if (d->fds[i] > *maxfd) *maxfd = d->fds[i];
+  }
+  if (d->next < d->naddrs && d->next_time - now < *wait_ms)
+    *wait_ms = d->next_time - now > 0 ? d->next_time - now : 0;
+}
+
+/* Look at the attempts select() found writable. Returns the connected
+ * socket, closing every other attempt, -1 if still dialing, or -2 if all
+ * the addresses failed (the reason is in d->error). */
+int dialCheck(tcpDialer *d, fd_set *writefds) {
+  int pending = 0;
+  for (int i = 0; i < d->next; i++) {
+    if (d->fds[i] == -1) continue;
+    if (FD_ISSET(d->fds[i], writefds)) {
+      int so_error = 0;
+      socklen_t len = sizeof(so_error);
+      getsockopt(d->fds[i], SOL_SOCKET, SO_ERROR, &so_error, &len);
+      if (so_error == 0) {
+        int sock = d->fds[i];
+        d->fds[i] = -1;
+        dialStop(d);
+        return sock;
+      }
+      d->error = so_error;
+      close(d->fds[i]);
+      d->fds[i] = -1;
+      d->next_time = 0; /* Don't wait to try the next one. */
+      continue;
+    }
+    pending++;
+  }
+  return (pending || d->next < d->naddrs) ? -1 : -2;
+}
+
+/* Dial host:port and wait for it. With 'ctrl_c', stdin is the user's
+ * terminal, and Ctrl+C gives up. Returns -1 with errno set on failure. */
+int dialWait(const char *host, int port, int ctrl_c) {
+  tcpDialer d;
+  char err[128];
+  if (dialStart(&d, host, port, err, sizeof(err)) == -1) {
+    fprintf(stderr, "Can't resolve %s: %s\n", host, err);
+    exit(EXIT_FAILURE);
+  }
+
+  while(1) {
+    fd_set readfds, writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    int maxfd = STDIN_FILENO;
+    long long wait_ms = 1000;
+    if (ctrl_c) FD_SET(STDIN_FILENO, &readfds);
+    dialFdSet(&d, &writefds, &maxfd, &wait_ms);
+    struct timeval tv = {wait_ms / 1000, (wait_ms % 1000) * 1000};
+
+    if (select(maxfd + 1, &readfds, &writefds, NULL, &tv) < 0) {
+      if (errno == EINTR) continue;
+      perror("select");
+      exit(EXIT_FAILURE);
+    }
+
+    // Check for Ctrl+C
+    if (ctrl_c && FD_ISSET(STDIN_FILENO, &readfds)) {
+      char c;
+      if (read(STDIN_FILENO, &c, 1) == 1) {
+        if (c == CTRL_C) {
+          write(STDOUT_FILENO, "\r\n", 2);
+          exit(0);
+        }
+      }
+    }
+
+    // Check for Connect Result
+    int sock = dialCheck(&d, &writefds);
+    if (sock >= 0) return sock;
+    if (sock == -2) {
+      errno = d.error;
+      dialStop(&d);
+      return -1;
+    }
+  }
+}
+
+int tcpConnect(const char *host, int port) {
+  fprintf(stderr, "Connecting to %s:%d... (Ctrl+C to quit)\n", host, port);
+  int sock = dialWait(host, port, 1);
+  if (sock == -1) {
+    fprintf(stderr, "Connection failed: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "Connected!\n");
+  return sock;
+}
+
+/* With --role stdio the peer is whatever is on the other end of stdin and
+ * stdout, typically "ssh host picturephone --role stdio". They are kept
+ * for the call, and the terminal is reopened in their place, so that the
+ * rest of the program keeps talking to the user through fds 0 and 1.
+ * Returns -1 if there is no terminal at all. */
+int stdioSetup(void) {
+  int tty = open("/dev/tty", O_RDWR);
+  if (tty == -1) return -1;
+  E.stdio_fds[0] = dup(STDIN_FILENO);
+  E.stdio_fds[1] = dup(STDOUT_FILENO);
+  dup2(tty, STDIN_FILENO);
+  dup2(tty, STDOUT_FILENO);
+  close(tty);
+  signal(SIGPIPE, SIG_IGN); /* The other end of the pipe went away. */
+  return 0;
+}
+
+/* Without a terminal, as when started by ssh, --role stdio relays its
+ * stdin and stdout to the call listening on --ip and --port: the peer on
+ * the other end of ssh reaches it with no port open to the outside.
+ * Bytes are only read from one side when the other can take them, so a
+ * slow pipe pushes back on the sender, whose convert stage then drops
+ * whole frames instead of queueing them. */
+void runStdioRelay(void) {
+  int sock = dialWait(E.net_ip, E.net_port, 0);
+  if (sock == -1) {
+    fprintf(stderr, "No call to relay to at %s:%d: %s\n", E.net_ip,
+        E.net_port, strerror(errno));
+    exit(1);
+  }
+  fcntl(sock, F_SETFL, 0);
+
+  int in[2] = {STDIN_FILENO, sock}, out[2] = {sock, STDOUT_FILENO};
+  unsigned char buf[2][16384];
+  int len[2] = {0, 0}, off[2] = {0, 0};
+
+  while (1) {
+    fd_set readfds, writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    for (int i = 0; i < 2; i++) {
+      if (len[i] == 0) FD_SET(in[i], &readfds);
+      else FD_SET(out[i], &writefds);
+    }
+    if (select(sock + 1, &readfds, &writefds, NULL, NULL) == -1) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    for (int i = 0; i < 2; i++) {
+      if (FD_ISSET(in[i], &readfds)) {
+        len[i] = read(in[i], buf[i], sizeof(buf[i]));
+        if (len[i] <= 0) return;
+        off[i] = 0;
+      } else if (FD_ISSET(out[i], &writefds)) {
+        int n = write(out[i], buf[i] + off[i], len[i] - off[i]);
+        if (n <= 0) return;
+        off[i] += n;
+        if (off[i] == len[i]) len[i] = 0;
+      }
+    }
+  }
+}
+
+/* With --encrypt, after the key exchange every packet or chunk travels in
+ * a record sealed with the key of its direction, numbered as its nonce.
+ * Control packets queued together share one record:
+ *
+ *   len (2 bytes, big endian) | len bytes of ciphertext | 16 bytes tag */
+#define NET_RECORD_MAX (2 + 65535 + 16)
+
+typedef struct {
+  int on;
+  unsigned char tx_key[32], rx_key[32];
+  uint64_t tx_seq, rx_seq;
+  unsigned char *raw;   /* Received records, not opened yet. */
+  int raw_len;
+  char code[16];        /* Security code, the same on both ends. */
+} netCrypto;
+
+/* A dropped connection doesn't end the call: the client dials again and
+ * the server accepts again, while the stages keep running. Packets sent
+ * meanwhile are dropped, and the last picture of the peer stays on. */
+#define LINK_UP 0    /* Packets flow. */
+#define LINK_DOWN 1  /* Broken: the main thread will replace the socket. */
+#define LINK_SETUP 2 /* A new socket, while the keys are exchanged. */
+
+/* Each end picks a random token for the whole call and sends it over
+ * every new connection, so that the peer can tell a reconnection from a
+ * different caller. */
+#define NET_TOKEN_LEN 8
+
+/* Features each end tells the other it supports, with 'F'. */
+#define NET_FEATURE_LZ 1     /* Decompresses 'Z' packets. */
+#define NET_FEATURE_LAYERS 2 /* Draws 'L' packets. */
+#define NET_FEATURE_VIEW 4   /* Crops its picture as asked with 'V'. */
+#define NET_FEATURE_TILES 8  /* Draws 'T' packets. */
+#define NET_FEATURE_REFS 16  /* Keeps tiles with 'M', restores with 'B'. */
+#define NET_FEATURE_CACHE 32 /* Draws cached tiles sent with 'X'. */
+#define NET_FEATURE_PROBE 64 /* Answers 'I' and the 'U' train. */
+#define NET_FEATURE_STAMPS 128 /* Skips late frames stamped with 'A'. */
+#define NET_FEATURE_STREAMS 256 /* Reassembles 'N' chunks. */
+#define NET_FEATURES_HEARD (1 << 16) /* Not sent: the peer's 'F' arrived. */
+#define NET_FEATURES (NET_FEATURE_LZ | NET_FEATURE_LAYERS | \
+    NET_FEATURE_VIEW | NET_FEATURE_TILES | NET_FEATURE_REFS | \
+    NET_FEATURE_CACHE | NET_FEATURE_PROBE | NET_FEATURE_STAMPS | \
+    NET_FEATURE_STREAMS)
+
+/* Packets belong to streams, that share the connection by priority:
+ *
+ *   0  control: what we want, see and hide, pings and their answers,
+ *      always small and sent whole, ahead of anything else
+ *   1  video: the frames, in as many packets as it takes
+ *
+ * A frame packet can take seconds to get through a slow link, and would
+ * hold up a ping or a resize behind it. So to peers that reassemble them,
+ * packets of other streams than control are cut into 'N' chunks, and the
+ * control packets queued meanwhile are sent between two chunks. Control
+ * packets are queued by whatever stage sends them, and sent by whichever
+ * holds the send lock next: that one is never kept waiting. */
+#define NET_STREAM_CONTROL 0
+#define NET_STREAM_VIDEO 1
+#define NET_STREAMS 2
+#define NET_CHUNK 1024        /* Largest chunk of a packet. */
+#define NET_CONTROL_MAX 256   /* Control packets queued at most, in bytes. */
+#define NET_PACKET_MAX (3 + 65535) /* A 'Z' packet, the largest. */
+#define NET_HDR_MAX 8         /* Header of an 'L', 'M', 'B' or 'X' packet. */
+
+/* Frames are held back this long after connecting, or until the features
+ * of the peer are known, so that the first one is not sent the slow way.
+ * Peers that never send 'F' are older ones. */
+#define NET_FEATURES_WAIT_MS 500
+
+/* After Ctrl-C, the send stage gets this long to finish the packet it is
+ * sending and say goodbye with 'Q'. */
+#define NET_HANGUP_MS 500
+
+/* Packets smaller than this are never worth compressing. */
+#define NET_LZ_MIN 64
+
+/* With --progressive, frames go out in layers, each drawn as it arrives:
+ *
+ *   0  the picture at half the width and height, 2 bits per pixel
+ *   1  the 4 high bits of every pixel
+ *   2  the 4 low bits of every pixel
+ *
+ * Pixels are stretched over lo..hi, the range of the frame, before being
+ * cut into bits. The base layer of a frame is always sent whole, but the
+ * refinement stops as soon as a newer frame is ready: on a slow link the
+ * motion stays visible, rather than freezing on sharp pictures. */
+#define LAYER_COUNT 3
+#define NET_NOTSENT_LOWAT 1024 /* Unsent bytes we let the kernel queue. */
+
+/* On a slow link the send stage is often still busy with a frame when the
+ * next one is converted, and by the time it gets to it, that one may be
+ * old news. Frames are whole pictures, so a late one can just be dropped:
+ * the next one replaces it anyway. Not the periodic refresh of the hidden
+ * area, nor the first frame at a new size, that the peer has no picture
+ * to stand in for. Before each frame we wait for the kernel to have
+ * almost nothing left to send, so that frames wait where they can still be
+ * dropped, not in the socket. */
+#define NET_FRAME_DEADLINE_MS 150
+
+/* The receiver has its own deadline, --max-delay, for the frames that
+ * got past the sender and then got stuck: after a stall, TCP hands over
+ * seconds of them at once, and drawing them all would keep the call that
+ * far behind. Each frame is stamped with the time it was taken, and as
+ * the clocks of the peers differ, its delay only counts above the
+ * shortest seen on the connection. Late frames still update the tiles and
+ * layers that later ones build on, they just aren't drawn. A link that
+ * stays slower than that is not a stall though: after frames were late
+ * for --max-delay in a row, their delay becomes the new shortest. */
+
+/* The first frames would otherwise go out at full size and rate whatever
+ * the link, and on a slow one queue for seconds. So on every connection
+ * we first ping the peer to time the round trip, and send a train of
+ * NET_PROBE_PACKETS back to back: the bottleneck of the link spaces them
+ * out, and the peer tells us how many bytes per second they arrived at.
+ * From that we pick the size, frame rate and layers to start with, for
+ * a frame estimated at half a byte per pixel once compressed. Frames are
+ * held back until the answer comes, or for NET_PROBE_WAIT_MS at most.
+ * A probe is only a snapshot of the link, so the start is a floor: every
+ * PROBE_RAMP_MS that the socket keeps draining without the send stage
+ * having to wait, it steps back up toward full size and rate, the frame
+ * rate first, then the size. */
+#define NET_PROBE_PACKETS 4
+#define NET_PROBE_BYTES 512
+#define NET_PROBE_WAIT_MS 1500
+#define NET_PROBE_FAST 0xffffffffu /* Arrived too close together to time. */
+#define PROBE_MAX_FPS 30
+#define PROBE_MIN_FPS 8    /* Below this, send a smaller picture first. */
+#define PROBE_MAX_SCALE 4
+#define PROBE_RAMP_MS 2000
+#define PROBE_RAMP_WAIT_US 1000 /* Waited less per frame: still drained. */
+
+/* With --max-rate, only the parts of the picture that changed are sent, as
+ * square tiles, and when they don't all fit in the bytes the rate allows
+ * the most important go first: those that changed the most, weighted up
+ * to 4 times more near the center, where faces usually are. Every frame a
+ * tile waits adds to its priority, so the background is refreshed too,
+ * just later. Tiles are compared with what the peer has, not with the
+ * previous frame, so slow drifts are eventually sent as well. */
+#define TILE_SIZE 16
+#define TILE_MAX ((255 + TILE_SIZE - 1) / TILE_SIZE * \
+                  ((255 + TILE_SIZE - 1) / TILE_SIZE))
+#define TILE_NOISE 6        /* Pixel differences up to this are noise. */
+#define TILE_AGE_WEIGHT 8   /* Priority gained per frame of waiting. */
+#define TILE_BURST_MS 200   /* Unused rate we may save up. */
+
+/* When someone leans out and comes back, the background they uncover is
+ * the same as before. So tiles that stay the same for a while are kept by
+ * both peers as references, up to TILE_REFS per tile, and a tile that
+ * looks like one of them again is restored with a few bytes instead of
+ * being sent. The sender says what to keep and where, so both always
+ * agree on what the references hold. */
+#define TILE_REFS 2
+#define TILE_STILL_FRAMES 30
+
+/* Tiles also recur elsewhere: dark corners, a plain wall, the same shirt
+ * after moving. Both peers put every tile sent with 'T' in a cache, in
+ * the slot picked by a hash of its coarse content, replacing whatever was
+ * there, so both caches always hold the same tiles. A tile that looks like
+ * the one in its slot is then sent as the slot number. */
+#define TILE_CACHE_BITS 8
+#define TILE_CACHE_SLOTS (1 << TILE_CACHE_BITS)
+
+/* How hard the send stage works to save bytes:
+ *
+ *   2  compression searches well, tiles are looked up in the references
+ *      and in the cache
+ *   1  compression skips faster through bytes that don't match
+ *   0  no compression, and tiles are just sent
+ *
+ * The level is picked again after every frame from the time it took,
+ * without counting the waits for the link. Over most of the time a frame
+ * lasts, it steps down right away; under a quarter of it for a second, it
+ * steps back up. So on a busy CPU we send bigger frames, but never fall
+ * behind the camera. */
+#define EFFORT_MAX 2
+#define EFFORT_FRAME_US 33000 /* The camera gives ~30 FPS. */
+#define EFFORT_UP_FRAMES 30
+
+/* The state shared by the stages of the network pipeline. Besides the
+ * rings, everything is either set up before the threads that use it start,
+ * atomic, or guarded by a lock: send_lock for the connection, the crypto
+ * and the compression state, control_lock for the control queue. */
+struct pipeline {
+  camera *cam;
+  int sockfd;                /* Where packets are read from, and */
+  int outfd;                 /* written to: the socket, or stdin/stdout. */
+  netCrypto crypto;          /* Only changed while the link is not up. */
+  pthread_mutex_t send_lock; /* Packets from different stages don't mix. */
+  pthread_mutex_t control_lock; /* Guards the control queue: */
+  unsigned char control[NET_CONTROL_MAX]; /* packets to send first, */
+  int control_len;           /* and their bytes. */
+  atomic_int running;        /* Cleared to ask every stage to exit. */
+  atomic_int link;           /* LINK_UP, LINK_DOWN or LINK_SETUP. */
+  atomic_uint link_gen;      /* Incremented each time the link comes up. */
+  atomic_uint rx_parked;     /* link_gen of the link the receive stage saw
+                                down, and stopped reading. */
+  int setup_fd;              /* Connection being brought up, */
+  atomic_int setup_result;   /* 1 meanwhile, then what netLinkUp said. */
+  unsigned char token[NET_TOKEN_LEN]; /* Ours, for this call. */
+  atomic_int peer_features;  /* NET_FEATURE_* the peer announced. */
+  atomic_llong link_up_time; /* When the link last came up. */
+  atomic_int hangup;         /* Ctrl-C: the send stage says goodbye. */
+  lzStream lz;               /* Compressed packets, under send_lock. */
+  unsigned char *lz_out;
+  atomic_int effort;         /* 0..EFFORT_MAX, picked by the send stage. */
+  atomic_int peer_w;         /* Resolution the peer wants to receive. */
+  atomic_int peer_h;
+  atomic_int redraw;         /* Compose should repaint, e.g. view toggled. */
+  atomic_int resizing;       /* The window is being resized right now. */
+  atomic_ullong peer_hidden; /* Area of our picture the peer can't see. */
+  atomic_ullong my_hidden;   /* Area of the peer picture we can't see. */
+  atomic_uint peer_view;     /* Part of our picture the peer looks at, */
+  atomic_uint my_view;       /* and of its picture we look at. */
+  atomic_llong probe_time;   /* When the probe was sent, 0 if not yet. */
+  atomic_int probed;         /* The peer answered the probe. */
+  atomic_int rtt_ms;         /* Round trip time measured by the probe. */
+  atomic_llong pong_time;    /* When the last answer to 'I' came. */
+  atomic_int send_scale;     /* Frames are 1/send_scale of peer_w*peer_h, */
+  atomic_int send_fps;       /* at most this many per second, */
+  atomic_int send_layers;    /* and with this many layers. */
+
+  spscRing capture;  /* capture -> convert: BGRA camera frames. */
+  spscRing outgoing; /* convert -> send: grayscale frames for the peer. */
+  spscRing selfview; /* convert -> compose: grayscale self view. */
+  spscRing incoming; /* receive -> compose: grayscale frames from the peer. */
+  spscRing tty;      /* compose -> tty write: escape sequences. */
+
+  vtModel vt;        /* Owned by the tty stage, with --vt-check. */
+};
+
+/* A window size is considered settled when it didn't change for this long.
+ * Until then we draw at whatever size the window has, but don't rebuild our
+ * state or renegotiate the resolution with the peer. */
+#define RESIZE_SETTLE_MS 150
+
+/* How often the client dials again while the connection is down. */
+#define NET_REDIAL_MS 500
+
+/* A connection accepted while the call is up may be the peer dialing
+ * again over a link that died on its side only, or anyone else. So the
+ * peer is pinged over the current link: if it answers within this long
+ * the newcomer is turned away, else the link is dropped for it. Peers
+ * that don't answer pings are left alone. */
+#define NET_LIVENESS_MS 2000
+
+/* Frames are sent to the peer in slices of rows, at most this many plus
+ * two, since slices are also split where the hidden area starts and ends. */
+#define NET_SLICES 8
+
+/* Every this many frames the area hidden by the receiver is sent anyway, so
+ * that it is never too stale when it becomes visible again. */
+#define HIDDEN_REFRESH 30
+
+/* A hidden area of a w*h picture, packed in a single integer so that it
+ * can be handed from a stage to another atomically. */
+unsigned long long packHiddenArea(int w, int h, rect a) {
+  return (unsigned long long)w | (unsigned long long)h << 8 |
+         (unsigned long long)a.x << 16 | (unsigned long long)a.y << 24 |
+         (unsigned long long)a.w << 32 | (unsigned long long)a.h << 40;
+}
+
+/* Unpack the hidden area, returning 0 if it doesn't refer to a w*h picture
+ * or is empty. */
+int unpackHiddenArea(unsigned long long packed, int w, int h, rect *a) {
+  if ((int)(packed & 0xff) != w || (int)(packed >> 8 & 0xff) != h) return 0;
+  a->x = packed >> 16 & 0xff;
+  a->y = packed >> 24 & 0xff;
+  a->w = packed >> 32 & 0xff;
+  a->h = packed >> 40 & 0xff;
+  return a->w > 0 && a->h > 0;
+}
+
+/* The receiver can zoom into the picture of the peer: it tells the peer
+ * the part it wants to see, as x, y, w, h in 1/255 of the camera frame,
+ * and the peer converts just that part at the usual resolution, so the
+ * picture gets more detailed instead of just bigger. Packed in an integer
+ * like the hidden area. */
+#define VIEW_FULL 0xffff0000u /* 0, 0, 255, 255 */
+#define VIEW_MAX_ZOOM 3       /* Beyond 8x cameras have no detail left. */
+
+/* Area of a fw*fh camera frame that the view refers to. */
+rect viewArea(unsigned int view, int fw, int fh) {
+  rect a = {(view & 0xff) * fw / 255, (view >> 8 & 0xff) * fh / 255,
+            (view >> 16 & 0xff) * fw / 255, (view >> 24) * fh / 255};
+  if (a.w < 1) a.w = 1;
+  if (a.h < 1) a.h = 1;
+  return a;
+}
+
+/* Zoom in or out of the view with '+' and '-', pan with the arrows, and
+ * go back to the whole picture with '0'. Returns the new view. */
+unsigned int moveView(unsigned int view, int key) {
+  int size = view >> 16 & 0xff;
+  int cx = (view & 0xff) + size / 2;
+  int cy = (view >> 8 & 0xff) + size / 2;
+  int step = size / 4 > 0 ? size / 4 : 1;
+
+  switch (key) {
+    case '+': case '=':
+      if (size > 255 >> VIEW_MAX_ZOOM) size /= 2;
+      break;
+    case '-': size = size * 2 + 1 > 255 ? 255 : size * 2 + 1; break;
+    case '0': size = 255; break;
+    case ARROW_LEFT: cx -= step; break;
+    case ARROW_RIGHT: cx += step; break;
+    case ARROW_UP: cy -= step; break;
+    case ARROW_DOWN: cy += step; break;
+  }
+  int x = cx - size / 2, y = cy - size / 2;
+  if (x > 255 - size) x = 255 - size;
+  if (y > 255 - size) y = 255 - size;
+  if (x < 0) x = 0;
+  if (y < 0) y = 0;
+  return x | y << 8 | (unsigned int)size << 16 | (unsigned int)size << 24;
+}
+
+/* Find the longest run of non zero entries in 'v'. */
+void longestRun(unsigned char *v, int len, int *start, int *runlen) {
+  *start = *runlen = 0;
+  for (int i = 0; i < len; ) {
+    if (!v[i]) {
+      i++;
+      continue;
+    }
+    int j = i;
+    while (j < len && v[j]) j++;
+    if (j - i > *runlen) {
+      *start = i;
+      *runlen = j - i;
+    }
+    i = j;
+  }
+}
+
+/* Find the area of a w*h peer picture, drawn mirrored into 'peer_r', that
+ * ends up entirely covered by 'self_r'. The area can't be seen, so there is
+ * no point in having the peer send it. Returns 0 if there is no such area,
+ * or if it is too small to be worth the trouble. */
+int coveredPictureArea(rect peer_r, rect self_r, int w, int h, rect *area) {
+  unsigned char col_hidden[256], row_hidden[256];
+  if (w <= 0 || h <= 0 || w > 255 || h > 255) return 0;
+  if (peer_r.w <= 0 || peer_r.h <= 0) return 0;
+
+  /* The mapping from cells to pixels is separable, so a pixel is hidden
+   * when all the columns and all the rows showing it are covered. */
+  memset(col_hidden, 1, w);
+  memset(row_hidden, 1, h);
+  for (int x = 0; x < peer_r.w; x++) {
+    int sx = peer_r.x + x;
+    if (sx >= self_r.x && sx < self_r.x + self_r.w) continue;
+    int ix = ((peer_r.w-1-x)*w)/peer_r.w;
+    col_hidden[ix < w ? ix : w-1] = 0;
+  }
+  for (int y = 0; y < peer_r.h; y++) {
+    int sy = peer_r.y + y;
+    if (sy >= self_r.y && sy < self_r.y + self_r.h) continue;
+    int iy = (y*h)/peer_r.h;
+    row_hidden[iy < h ? iy : h-1] = 0;
+  }
+
+  longestRun(col_hidden, w, &area->x, &area->w);
+  longestRun(row_hidden, h, &area->y, &area->h);
+  return area->w >= 4 && area->h >= 2;
+}
+
+/* Compute where the peer picture and our own self view go on a screen of
+ * cols*rows cells, for the given view mode. */
+void computeLayout(int view_mode, int cols, int rows, rect *peer, rect *self) {
+  if (view_mode == VIEW_PIP) {
+    /* Peer fullscreen, self small (bottom right). */
+    int sw = cols / 4;
+    int sh = rows / 4;
+    if (sw < 10) sw = 10;
+    if (sh < 5) sh = 5;
+    *peer = (rect){0, 0, cols, rows};
+    *self = (rect){cols - sw - 2, rows - sh - 2, sw, sh};
+  } else {
+    /* Split screen. */
+    int half_w = cols / 2;
+    *peer = (rect){0, 0, half_w, rows};
+    *self = (rect){half_w, 0, cols - half_w, rows};
+  }
+}
+
+/* computeLayout() for the screen as it is right now. The main thread
+ * changes the size and view mode while the other stages lay out. */
+void currentLayout(rect *peer, rect *self) {
+  computeLayout(atomic_load(&E.view_mode), atomic_load(&E.screencols),
+                atomic_load(&E.screenrows), peer, self);
+}
+
+/* The resolution to ask the peer for: the size of the area its picture
+ * is drawn into with the current screen size and view mode, since sampling
+ * any finer would just be thrown away. */
+void wantedPeerResolution(int *w, int *h) {
+  rect peer_r, self_r;
+  currentLayout(&peer_r, &self_r);
+  *w = peer_r.w > 255 ? 255 : peer_r.w;
+  *h = peer_r.h > 255 ? 255 : peer_r.h;
+  if (*w < 1) *w = 1;
+  if (*h < 1) *h = 1;
+}
+
+/* Time the calling thread spent waiting in writeAll() and
+ * netWaitWritable() for a descriptor to drain. It is per thread, since
+ * whichever stage holds send_lock writes the queued packets, and the tty
+ * stage writes too: a shared counter would charge one stage with the waits
+ * of another. */
+static _Thread_local long long thread_wait_us;
+
+/* Write the whole buffer to 'fd', waiting for it to become writable when
+ * it is non blocking. Returns 0 on success, -1 on error or if the pipeline
+ * was asked to stop, or the link went down, while waiting. */
+int writeAll(struct pipeline *p, int fd, const unsigned char *buf, int len) {
+  while (len > 0) {
+    int n = write(fd, buf, len);
+    if (n > 0) {
+      buf += n;
+      len -= n;
+      continue;
+    }
+    if (n == -1 && errno != EAGAIN && errno != EINTR) return -1;
+    if (!atomic_load(&p->running) || atomic_load(&p->link) == LINK_DOWN)
+      return -1;
+
+    fd_set writefds;
+    FD_ZERO(&writefds);
+    FD_SET(fd, &writefds);
+    struct timeval tv = {0, 100000};
+    long long start = microseconds();
+    select(fd + 1, NULL, &writefds, NULL, &tv);
+    thread_wait_us += microseconds() - start;
+  }
+  return 0;
+}
+
+/* Read exactly len bytes, giving up after timeout_ms. */
+int readAll(struct pipeline *p, int fd, unsigned char *buf, int len,
+            int timeout_ms) {
+  long long deadline = current_timestamp() + timeout_ms;
+  while (len > 0) {
+    int n = read(fd, buf, len);
+    if (n > 0) {
+      buf += n;
+      len -= n;
+      continue;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR)) return -1;
+    if (!atomic_load(&p->running) || current_timestamp() > deadline)
+      return -1;
+
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(fd, &readfds);
+    struct timeval tv = {0, 100000};
+    select(fd + 1, &readfds, NULL, NULL, &tv);
+  }
+  return 0;
+}
+
+int randomBytes(unsigned char *buf, int len) {
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd == -1) return -1;
+  int n = read(fd, buf, len);
+  close(fd);
+  return n == len ? 0 : -1;
+}
+
+/* Key exchange: 'K' followed by an ephemeral X25519 public key, sent by
+ * both ends in the clear. A key for each direction and the security code
+ * are derived from the shared secret, into 'c'. Nobody listening can
+ * read the call, but only comparing the security codes tells that nobody
+ * is in the middle. Returns -1 if the peer doesn't do the same. */
+int netHandshake(struct pipeline *p, int infd, int outfd, netCrypto *c) {
+  unsigned char secret[32], pkt[33], peer[33];
+
+  if (randomBytes(secret, sizeof(secret)) == -1) return -1;
+  pkt[0] = 'K';
+  x25519Base(pkt + 1, secret);
+  if (writeAll(p, outfd, pkt, sizeof(pkt)) == -1 ||
+      readAll(p, infd, peer, sizeof(peer), 10000) == -1 ||
+      peer[0] != 'K')
+  {
+    return -1;
+  }
+
+  static const unsigned char zeros[16];
+  unsigned char shared[32], key[32], keys[96] = {0};
+  x25519(shared, secret, peer + 1);
+  unsigned char any = 0;
+  for (int i = 0; i < 32; i++) any |= shared[i];
+  if (!any) return -1; /* Low order point: no secret at all. */
+
+  chachaStream cs;
+  hchacha20(key, shared, zeros);
+  chachaInit(&cs, key, 0, zeros);
+  chachaXor(&cs, keys, keys, sizeof(keys));
+  /* Whoever has the lower public key sends with the first key: roles
+   * don't tell, as both ends of a stdio call may be --role stdio. */
+  int first = memcmp(pkt + 1, peer + 1, 32) < 0;
+  memcpy(c->tx_key, keys + (first ? 0 : 32), 32);
+  memcpy(c->rx_key, keys + (first ? 32 : 0), 32);
+  snprintf(c->code, sizeof(c->code), "%02x%02x-%02x%02x",
+      keys[64], keys[65], keys[66], keys[67]);
+  memset(secret, 0, sizeof(secret));
+  memset(shared, 0, sizeof(shared));
+
+  c->tx_seq = c->rx_seq = 0;
+  c->on = 1;
+  return 0;
+}
+
+/* Seal a packet into a record. The payload is encrypted in place, so it
+ * is not copied on the way to the socket. Headers are at most those of a
+ * chunk and of the packet it starts, the control queue going as payload. */
+int netSendRecord(struct pipeline *p, const unsigned char *hdr, int hdrlen,
+    unsigned char *payload, int len) {
+  netCrypto *c = &p->crypto;
+  unsigned char head[2 + 4 + NET_HDR_MAX], tag[16];
+  if (hdrlen > 4 + NET_HDR_MAX) return -1;
+  int total = hdrlen + len;
+  head[0] = total >> 8;
+  head[1] = total & 0xff;
+  memcpy(head + 2, hdr, hdrlen);
+
+  aead a;
+  aeadBegin(&a, c->tx_key, c->tx_seq++, head, 2);
+  aeadEncrypt(&a, head + 2, hdrlen);
+  if (len > 0) aeadEncrypt(&a, payload, len);
+  aeadFinish(&a, tag);
+
+  if (writeAll(p, p->outfd, head, 2 + hdrlen) == -1) return -1;
+  if (len > 0 && writeAll(p, p->outfd, payload, len) == -1) return -1;
+  return writeAll(p, p->outfd, tag, sizeof(tag));
+}
+
+/* Is a complete record waiting to be opened? */
+int netPending(struct pipeline *p) {
+  netCrypto *c = &p->crypto;
+  if (!c->on || c->raw_len < 2) return 0;
+  return c->raw_len >= 2 + (c->raw[0] << 8 | c->raw[1]) + 16;
+}
+
+/* Read what the peer sent into buf. With encryption, records are collected
+ * until complete and only their authenticated plaintext ends up in buf:
+ * -1 with EAGAIN when no record is complete yet, EBADMSG if forged. */
+int netRead(struct pipeline *p, unsigned char *buf, int space) {
+  netCrypto *c = &p->crypto;
+  if (!c->on) return read(p->sockfd, buf, space);
+
+  if (c->raw_len < 2 * NET_RECORD_MAX) {
+    int n = read(p->sockfd, c->raw + c->raw_len,
+        2 * NET_RECORD_MAX - c->raw_len);
+    if (n == 0) return 0;
+    if (n < 0 && errno != EAGAIN && errno != EINTR) return -1;
+    if (n > 0) c->raw_len += n;
+  }
+
+  int out = 0, used = 0;
+  while (c->raw_len - used >= 2) {
+    unsigned char *rec = c->raw + used;
+    int len = rec[0] << 8 | rec[1];
+    if (c->raw_len - used < 2 + len + 16 || len > space - out) break;
+
+    aead a;
+    aeadBegin(&a, c->rx_key, c->rx_seq++, rec, 2);
+    aeadAuthenticate(&a, rec + 2, len);
+    if (!aeadVerify(&a, rec + 2 + len)) {
+      errno = EBADMSG;
+      return -1;
+    }
+    chachaXor(&a.cs, buf + out, rec + 2, len);
+    out += len;
+    used += 2 + len + 16;
+  }
+  c->raw_len -= used;
+  memmove(c->raw, c->raw + used, c->raw_len);
+
+  if (out == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return out;
+}
+
+/* The connection broke: stop sending, and let the main thread replace
+ * the socket. A stdio call can't be dialed again, so it just ends. */
+void netLinkDown(struct pipeline *p) {
+  if (E.net_role == NET_ROLE_STDIO) {
+    atomic_store(&p->running, 0);
+    return;
+  }
+  int up = LINK_UP;
+  if (atomic_compare_exchange_strong(&p->link, &up, LINK_DOWN))
+    editorSetStatusMessage("Connection lost, reconnecting...");
+}
+
+/* Write a packet, or part of one, to the link: sealed in a record with
+ * encryption, in which case the payload is overwritten. Call with the
+ * send lock held. */
+int netWritePacket(struct pipeline *p, const unsigned char *hdr, int hdrlen,
+    unsigned char *payload, int len) {
+  if (p->crypto.on) return netSendRecord(p, hdr, hdrlen, payload, len);
+  if (writeAll(p, p->outfd, hdr, hdrlen) == -1) return -1;
+  return len > 0 ? writeAll(p, p->outfd, payload, len) : 0;
+}
+
+/* Send the control packets queued so far. Call with the send lock held. */
+int netFlushControl(struct pipeline *p) {
+  unsigned char pkts[NET_CONTROL_MAX];
+  pthread_mutex_lock(&p->control_lock);
+  int len = p->control_len;
+  memcpy(pkts, p->control, len);
+  p->control_len = 0;
+  pthread_mutex_unlock(&p->control_lock);
+  if (len == 0 || atomic_load(&p->link) != LINK_UP) return 0;
+  if (netWritePacket(p, pkts, 0, pkts, len) == 0) return 0;
+  netLinkDown(p);
+  return -1;
+}
+
+/* Release the send lock, but not before sending the control packets
+ * queued meanwhile, including those queued while we let go of it. */
+void netUnlock(struct pipeline *p) {
+  for (;;) {
+    netFlushControl(p);
+    pthread_mutex_unlock(&p->send_lock);
+    pthread_mutex_lock(&p->control_lock);
+    int pending = p->control_len > 0;
+    pthread_mutex_unlock(&p->control_lock);
+    if (!pending || pthread_mutex_trylock(&p->send_lock) != 0) return;
+  }
+}
+
+/* Queue a control packet. Returns -1 if the queue is full. */
+int netQueueControl(struct pipeline *p, const unsigned char *pkt, int len) {
+  pthread_mutex_lock(&p->control_lock);
+  int fits = p->control_len + len <= NET_CONTROL_MAX;
+  if (fits) {
+    memcpy(p->control + p->control_len, pkt, len);
+    p->control_len += len;
+  }
+  pthread_mutex_unlock(&p->control_lock);
+  return fits ? 0 : -1;
+}
+
+/* Send a packet of the control stream: right away if nobody is sending,
+ * else between two chunks of what is being sent. Any stage may call
+ * this. While the link is not up the packet is silently dropped. */
+int netSendControl(struct pipeline *p, const unsigned char *pkt, int len) {
+  if (atomic_load(&p->link) != LINK_UP) return 0;
+  if (netQueueControl(p, pkt, len) == 0) {
+    if (pthread_mutex_trylock(&p->send_lock) == 0) netUnlock(p);
+    return 0;
+  }
+  /* Full: wait for our turn. */
+  pthread_mutex_lock(&p->send_lock);
+  int retval = netFlushControl(p);
+  if (retval == 0 && netQueueControl(p, pkt, len) == 0)
+    retval = netFlushControl(p);
+  netUnlock(p);
+  return retval;
+}
+
+/* Send a packet of the video stream, made of a header and an optional
+ * payload. Any stage may call this: the lock keeps packets from different
+ * stages from being interleaved on the wire, and keep the compression
+ * history in the order packets are sent. Packets larger than a chunk are
+ * cut in 'N' s n <data> chunks, where s is the stream, plus 128 for the
+ * last chunk, and n the bytes of the chunk (2 bytes, big endian), with
+ * control packets in between. With encryption the payload is overwritten.
+ * While the link is not up the packet is silently dropped. */
+int netSendPacket(struct pipeline *p, const unsigned char *hdr, int hdrlen,
+    unsigned char *payload, int len) {
+  if (atomic_load(&p->link) != LINK_UP) return 0;
+  if (hdrlen > NET_HDR_MAX) return -1;
+  pthread_mutex_lock(&p->send_lock);
+  if (atomic_load(&p->link) != LINK_UP) {
+    /* Went down while we were waiting for the lock. */
+    pthread_mutex_unlock(&p->send_lock);
+    return 0;
+  }
+
+  unsigned char zip_hdr[3];
+  int effort = atomic_load(&p->effort);
+  if ((atomic_load(&p->peer_features) & NET_FEATURE_LZ) &&
+      hdrlen + len >= NET_LZ_MIN && effort > 0)
+  {
+    /* Sent compressed only if that makes it smaller. */
+    unsigned char *block = lzNextBlock(&p->lz);
+    memcpy(block, hdr, hdrlen);
+    if (len > 0) memcpy(block + hdrlen, payload, len);
+    int n = lzCompress(&p->lz, hdrlen + len, p->lz_out, hdrlen + len - 3,
+        effort == EFFORT_MAX ? 6 : 3);
+    if (n != -1) {
+      zip_hdr[0] = 'Z';
+      zip_hdr[1] = n >> 8;
+      zip_hdr[2] = n & 0xff;
+      hdr = zip_hdr;
+      hdrlen = 3;
+      payload = p->lz_out;
+      len = n;
+    }
+  }
+
+  int retval = netFlushControl(p);
+  if (!(atomic_load(&p->peer_features) & NET_FEATURE_STREAMS) ||
+      hdrlen + len <= NET_CHUNK)
+  {
+    if (retval == 0) retval = netWritePacket(p, hdr, hdrlen, payload, len);
+    netUnlock(p);
+    return retval;
+  }
+
+  /* The first chunk carries the header of the packet too. */
+  unsigned char chunk_hdr[4 + NET_HDR_MAX] = {'N'};
+  int chunk_hdrlen = 4 + hdrlen;
+  memcpy(chunk_hdr + 4, hdr, hdrlen);
+  while (retval == 0) {
+    int n = len > NET_CHUNK - (chunk_hdrlen - 4) ?
+            NET_CHUNK - (chunk_hdrlen - 4) : len;
+    int size = chunk_hdrlen - 4 + n;
+    chunk_hdr[1] = NET_STREAM_VIDEO | (n == len ? 128 : 0);
+    chunk_hdr[2] = size >> 8;
+    chunk_hdr[3] = size & 0xff;
+    retval = netWritePacket(p, chunk_hdr, chunk_hdrlen, payload, n);
+    payload += n;
+    len -= n;
+    chunk_hdrlen = 4;
+    if (len == 0) break;
+    if (retval == 0) retval = netFlushControl(p);
+  }
+  netUnlock(p);
+  return retval;
+}
+
+/* Start using a new connection: exchange keys again if encrypting, so
+ * that no nonce is ever reused, then tell the peer who we are. Must be
+ * called with the receive stage parked. Returns -1 if the key exchange
+ * failed, leaving the link down. */
+int netLinkUp(struct pipeline *p, int infd, int outfd) {
+  fcntl(infd, F_SETFL, O_NONBLOCK);
+  fcntl(outfd, F_SETFL, O_NONBLOCK);
+#ifdef TCP_NOTSENT_LOWAT
+  /* Keep the unsent queue short, so that the send stage waits for the
+   * link, and sees newer frames, instead of the kernel buffering whole
+   * seconds of stale ones. Fails harmlessly on pipes. */
+  int lowat = NET_NOTSENT_LOWAT;
+  setsockopt(outfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+#endif
+  /* The key exchange may wait seconds for the peer: not with the lock
+   * held, the link not being up nobody else touches the new socket. */
+  atomic_store(&p->link, LINK_SETUP);
+  netCrypto fresh;
+  memset(&fresh, 0, sizeof(fresh));
+  int retval = E.encrypt ? netHandshake(p, infd, outfd, &fresh) : 0;
+
+  pthread_mutex_lock(&p->send_lock);
+  p->sockfd = infd;
+  p->outfd = outfd;
+  if (retval == 0 && fresh.on) {
+    fresh.raw = p->crypto.raw ? p->crypto.raw : malloc(2 * NET_RECORD_MAX);
+    p->crypto = fresh;
+  }
+  lzReset(&p->lz);
+  atomic_store(&p->peer_features, 0);
+  pthread_mutex_lock(&p->control_lock);
+  p->control_len = 0; /* Meant for the old connection. */
+  pthread_mutex_unlock(&p->control_lock);
+  atomic_store(&p->probe_time, 0);
+  atomic_store(&p->probed, 0);
+  atomic_store(&p->send_scale, 1);
+  atomic_store(&p->send_fps, PROBE_MAX_FPS);
+  atomic_store(&p->send_layers, LAYER_COUNT);
+  if (retval == 0) {
+    /* Before anything the stages may send now that the link is up. */
+    unsigned char resume_pkt[1 + NET_TOKEN_LEN] = {'R'};
+    memcpy(resume_pkt + 1, p->token, NET_TOKEN_LEN);
+    unsigned char features_pkt[3] = {'F',
+      NET_FEATURES & 0xff, NET_FEATURES >> 8};
+    netQueueControl(p, resume_pkt, sizeof(resume_pkt));
+    netQueueControl(p, features_pkt, 3);
+    atomic_store(&p->link_up_time, current_timestamp());
+    atomic_fetch_add(&p->link_gen, 1);
+    atomic_store(&p->link, LINK_UP);
+  } else {
+    p->sockfd = p->outfd = -1;
+    atomic_store(&p->link, LINK_DOWN);
+  }
+  netUnlock(p);
+  return retval;
+}
+
+/* Bring up the connection in p->setup_fd, off the main thread, so that
+ * the keyboard still works while the key exchange waits for the peer. */
+void *linkThread(void *arg) {
+  struct pipeline *p = arg;
+  atomic_store(&p->setup_result,
+      netLinkUp(p, p->setup_fd, p->setup_fd));
+  return NULL;
+}
+
+/* Wait up to timeout_ms for the link to take more data: with
+ * TCP_NOTSENT_LOWAT, until the kernel has almost nothing left to send. */
+void netWaitWritable(struct pipeline *p, int timeout_ms) {
+  pthread_mutex_lock(&p->send_lock);
+  int fd = p->outfd;
+  netUnlock(p);
+  if (fd == -1 || atomic_load(&p->link) != LINK_UP) return;
+
+  fd_set writefds;
+  FD_ZERO(&writefds);
+  FD_SET(fd, &writefds);
+  struct timeval tv = {0, timeout_ms * 1000};
+  long long start = microseconds();
+  select(fd + 1, NULL, &writefds, NULL, &tv);
+  thread_wait_us += microseconds() - start;
+}
+
+/* Ping the peer with 'I' and our clock. */
+int netSendPing(struct pipeline *p) {
+  unsigned int now = (unsigned int)current_timestamp();
+  unsigned char ping_pkt[5] = {'I', now & 0xff, now >> 8 & 0xff,
+    now >> 16 & 0xff, now >> 24};
+  return netSendControl(p, ping_pkt, 5);
+}
+
+/* Ping the peer, then send the probe train as 'U' i n, padded to
+ * NET_PROBE_BYTES with random bytes that don't compress. */
+int netSendProbe(struct pipeline *p) {
+  if (netSendPing(p) == -1) return -1;
+
+  /* Refilled every time: with encryption it is overwritten. */
+  unsigned char padding[NET_PROBE_BYTES - 3];
+  for (int i = 0; i < NET_PROBE_PACKETS; i++) {
+    unsigned char probe_hdr[3] = {'U', i, NET_PROBE_PACKETS};
+    if (randomBytes(padding, sizeof(padding)) == -1 ||
+        netSendPacket(p, probe_hdr, 3, padding, sizeof(padding)) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/* The peer measured the probe train at 'bps' bytes per second: pick the
+ * largest picture that still allows PROBE_MIN_FPS, then as many frames
+ * per second as fit. Only the base and the high bits go in layers when
+ * even the smallest picture can't reach it. */
+void netApplyProbe(struct pipeline *p, unsigned int bps) {
+  int pixels = atomic_load(&p->peer_w) * atomic_load(&p->peer_h);
+  int scale = 1, fps = PROBE_MAX_FPS;
+  if (bps != NET_PROBE_FAST) {
+    long long frame_bytes = pixels / 2 + 1;
+    while (bps / frame_bytes < PROBE_MIN_FPS && scale < PROBE_MAX_SCALE) {
+      scale *= 2;
+      frame_bytes = pixels / 2 / (scale * scale) + 1;
+    }
+    fps = bps / frame_bytes;
+    if (fps > PROBE_MAX_FPS) fps = PROBE_MAX_FPS;
+    if (fps < 1) fps = 1;
+  }
+  int layers = fps < PROBE_MIN_FPS ? LAYER_COUNT - 1 : LAYER_COUNT;
+  atomic_store(&p->send_scale, scale);
+  atomic_store(&p->send_fps, fps);
+  atomic_store(&p->send_layers, layers);
+  atomic_store(&p->probed, 1);
+  if (bps == NET_PROBE_FAST) return;
+  editorSetStatusMessage("Link ~%u KB/s, RTT %d ms: starting at 1/%d size, "
+      "%d FPS.", bps / 1024, atomic_load(&p->rtt_ms), scale, fps);
+}
+
+/* Waits for the link while sending the current frame, and since when the
+ * frames went out without any. */
+typedef struct {
+  long long wait_us;
+  long long calm_since;
+} probeRamp;
+
+/* A frame was sent: if the link kept up for PROBE_RAMP_MS, double the
+ * frame rate, or once at the full rate, double the size at a quarter of
+ * it, for about the same bytes per second. */
+void rampProbe(struct pipeline *p, probeRamp *r) {
+  long long now = current_timestamp();
+  long long waited = r->wait_us;
+  r->wait_us = 0;
+  if (!atomic_load(&p->probed) || waited > PROBE_RAMP_WAIT_US ||
+      r->calm_since == 0)
+  {
+    r->calm_since = now;
+    return;
+  }
+  if (now - r->calm_since < PROBE_RAMP_MS) return;
+  r->calm_since = now;
+
+  int scale = atomic_load(&p->send_scale);
+  int fps = atomic_load(&p->send_fps);
+  if (fps < PROBE_MAX_FPS) {
+    fps = fps * 2 > PROBE_MAX_FPS ? PROBE_MAX_FPS : fps * 2;
+  } else if (scale > 1) {
+    scale /= 2;
+    fps = fps / 4 < PROBE_MIN_FPS ? PROBE_MIN_FPS : fps / 4;
+  } else {
+    return;
+  }
+  atomic_store(&p->send_scale, scale);
+  atomic_store(&p->send_fps, fps);
+  atomic_store(&p->send_layers,
+      fps < PROBE_MIN_FPS ? LAYER_COUNT - 1 : LAYER_COUNT);
+  editorSetStatusMessage("Link keeps up: now at 1/%d size, %d FPS.",
+      scale, fps);
+}
+
+/* Is it time for another frame, at the rate picked by the probe? 'next'
+ * is when the next one is due. */
+int frameDue(struct pipeline *p, long long *next) {
+  int fps = atomic_load(&p->send_fps);
+  long long now = current_timestamp();
+  if (fps < PROBE_MAX_FPS && now < *next) return 0;
+  *next += 1000 / fps;
+  if (*next < now) *next = now;
+  return 1;
+}
+
+/* Tell the peer when the frame we are about to send was taken, if it
+ * skips late frames. */
+int netSendStamp(struct pipeline *p, long long time) {
+  if (!(atomic_load(&p->peer_features) & NET_FEATURE_STAMPS)) return 0;
+  unsigned int t = (unsigned int)time;
+  unsigned char stamp_pkt[5] = {'A', t & 0xff, t >> 8 & 0xff,
+    t >> 16 & 0xff, t >> 24};
+  return netSendPacket(p, stamp_pkt, 5, NULL, 0);
+}
+
+/* Tell the peer the resolution we want to receive. */
+int netSendConfig(struct pipeline *p, int w, int h) {
+  unsigned char conf_pkt[3] = {'C', (unsigned char)w, (unsigned char)h};
+  return netSendControl(p, conf_pkt, 3);
+}
+
+void sleepUntil(long long when) {
+  long long wait_ms = when - current_timestamp();
+  if (wait_ms <= 0) return;
+  struct timespec ts = {wait_ms / 1000, (wait_ms % 1000) * 1000000};
+  nanosleep(&ts, NULL);
+}
+
+/* Are frames sent in layers? Only if the peer can draw them. */
+int progressiveOn(struct pipeline *p) {
+  return E.progressive &&
+         (atomic_load(&p->peer_features) & NET_FEATURE_LAYERS);
+}
+
+/* Are frames sent in tiles, within --max-rate? Layers win if both. */
+int tilesOn(struct pipeline *p) {
+  return E.max_rate > 0 && !progressiveOn(p) &&
+         (atomic_load(&p->peer_features) & NET_FEATURE_TILES);
+}
+
+/* Capture stage: grab camera frames at ~30 FPS. */
+void *captureThread(void *arg) {
+  struct pipeline *p = arg;
+  long long next_frame_time = current_timestamp();
+
+  while (atomic_load(&p->running)) {
+    /* A broker pushes its frames: copy each one as soon as it's out. */
+    if (p->cam->notify_fd != -1 && !brokerWaitFrame(p->cam, 100)) continue;
+
+    frame frame;
+    if (cameraGetFrame(p->cam, &frame)) {
+      ringSlot *s = ringAcquire(&p->capture);
+      int size = frame.width * frame.height * 4;
+      if (s && ringSlotFit(s, size)) {
+        memcpy(s->data, frame.pixels, size);
+        s->width = frame.width;
+        s->height = frame.height;
+        s->time = current_timestamp();
+        s->len = size;
+        /* Lapped by the broker while copying: the slot is reused. */
+        if (cameraFrameIntact(p->cam)) ringPublish(&p->capture);
+      }
+    }
+    if (p->cam->notify_fd != -1) continue;
+
+    next_frame_time += 33; /* Target ~30 FPS */
+    long long now = current_timestamp();
+    if (next_frame_time < now) next_frame_time = now;
+    sleepUntil(next_frame_time);
+  }
+  return NULL;
+}
+
+/* Convert stage: downscale and grayscale the camera frame twice, once at
+ * the resolution the peer asked for, and once at the size of our own self
+ * view. The picture for the peer is converted a slice at a time, and every
+ * slice is handed to the send stage as soon as it is ready, so that the
+ * first rows are already on the wire while the last ones are converted.
+ * Pixels the peer reported as hidden behind its own self view are not even
+ * converted, and when the peer zoomed in only the part it looks at is. */
+void *convertThread(void *arg) {
+  struct pipeline *p = arg;
+  spscRing *inputs[] = {&p->capture};
+  unsigned int frame_count = 0;
+
+  while (atomic_load(&p->running)) {
+    ringSlot *s = ringPeekLatest(&p->capture);
+    if (s == NULL) {
+      ringWait(inputs, 1, 100);
+      continue;
+    }
+
+    frame in = {s->width, s->height, s->data};
+    int scale = atomic_load(&p->send_scale);
+    int w = (atomic_load(&p->peer_w) + scale - 1) / scale;
+    int h = (atomic_load(&p->peer_h) + scale - 1) / scale;
+    int slice_rows = (h + NET_SLICES - 1) / NET_SLICES;
+
+    /* Leave out what the peer can't see, except for a refresh now and
+     * then. Slices are split where the hidden area starts and ends. */
+    rect hide = {0, 0, 0, 0};
+    unsigned int frame_no = frame_count++;
+    int refresh = frame_no % HIDDEN_REFRESH == 0;
+    if (!refresh && !progressiveOn(p) &&
+        unpackHiddenArea(atomic_load(&p->peer_hidden), w, h, &hide) &&
+        (hide.x + hide.w > w || hide.y + hide.h > h))
+    {
+      hide = (rect){0, 0, 0, 0};
+    }
+
+    filterChain peer_chain;
+    filterChainInit(&peer_chain, &in, w, h);
+    peer_chain.src = viewArea(atomic_load(&p->peer_view), in.width,
+        in.height);
+
+    /* Frames are dropped as a whole when the send stage is behind: a
+     * partially sent frame would mix rows of different frames. */
+    if (ringSpace(&p->outgoing) >= NET_SLICES + 2) {
+      for (int y = 0; y < h; ) {
+        int end = (y + slice_rows > h) ? h : y + slice_rows;
+        if (y < hide.y && end > hide.y) end = hide.y;
+        if (y < hide.y + hide.h && end > hide.y + hide.h)
+          end = hide.y + hide.h;
+        int rows = end - y;
+        int inside = hide.w > 0 && y >= hide.y && y < hide.y + hide.h;
+        int hide_x = inside ? hide.x : 0;
+        int hide_w = inside ? hide.w : 0;
+
+        ringSlot *out = ringAcquire(&p->outgoing);
+        if (!ringSlotFit(out, (w - hide_w) * rows)) break;
+        filterChainRun(&peer_chain, out->data, y, rows, hide_x, hide_w);
+        out->width = w;
+        out->height = h;
+        out->y = y;
+        out->rows = rows;
+        out->hide_x = hide_x;
+        out->hide_w = hide_w;
+        out->time = s->time;
+        out->critical = refresh;
+        out->frame = frame_no;
+        out->len = (w - hide_w) * rows;
+        ringPublish(&p->outgoing);
+        y = end;
+      }
+    }
+
+    rect peer_r, self_r;
+    currentLayout(&peer_r, &self_r);
+    ringSlot *out = ringAcquire(&p->selfview);
+    if (out && self_r.w > 0 && self_r.h > 0 &&
+        ringSlotFit(out, self_r.w * self_r.h))
+    {
+      /* The range is collected while the rows are hot, so the compose
+       * stage doesn't walk the picture again to find it. */
+      filterChain self_chain;
+      int range[2] = {255, 0};
+      filterChainInit(&self_chain, &in, self_r.w, self_r.h);
+      filterChainAdd(&self_chain, rangeKernel, range);
+      filterChainRun(&self_chain, out->data, 0, self_r.h, 0, 0);
+      out->width = self_r.w;
+      out->height = self_r.h;
+      out->min = range[0];
+      out->max = range[1];
+      out->len = self_r.w * self_r.h;
+      ringPublish(&p->selfview);
+    }
+
+    ringRelease(&p->capture);
+  }
+  return NULL;
+}
+
+/* Size of a layer of a w*h picture, and the bytes of each of its rows. */
+int layerGeometry(int layer, int w, int h, int *lw, int *lh) {
+  *lw = layer == 0 ? (w + 1) / 2 : w;
+  *lh = layer == 0 ? (h + 1) / 2 : h;
+  return (*lw * (layer == 0 ? 2 : 4) + 7) / 8;
+}
+
+/* Send a whole w*h frame in layers, as 'L' w h layer y n lo hi <data>,
+ * where rows y..y+n-1 of the layer are packed 4 or 2 pixels to a byte,
+ * leftmost in the low bits. 'norm' and 'buf' are scratch space of w*h
+ * bytes. Returns -1 on error, 0 when done or superseded. */
+int sendLayers(struct pipeline *p, const unsigned char *pixels, int w, int h,
+    unsigned char *norm, unsigned char *buf) {
+  int lo = 255, hi = 0;
+  for (int i = 0; i < w * h; i++) {
+    if (pixels[i] < lo) lo = pixels[i];
+    if (pixels[i] > hi) hi = pixels[i];
+  }
+  int range = hi > lo ? hi - lo : 1;
+  for (int i = 0; i < w * h; i++)
+    norm[i] = ((pixels[i] - lo) * 255 + range / 2) / range;
+
+  int layers = atomic_load(&p->send_layers);
+  for (int layer = 0; layer < layers; layer++) {
+    int lw, lh, row_bytes = layerGeometry(layer, w, h, &lw, &lh);
+    int slice_rows = layer == 0 ? lh : (lh + NET_SLICES - 1) / NET_SLICES;
+    for (int y = 0; y < lh; y += slice_rows) {
+      /* The next frame is converted already: refining this one is
+       * pointless. */
+      if (layer > 0 && (ringPeek(&p->outgoing) != NULL ||
+                        atomic_load(&p->hangup))) return 0;
+
+      int rows = y + slice_rows > lh ? lh - y : slice_rows;
+      memset(buf, 0, rows * row_bytes);
+      for (int r = 0; r < rows; r++) {
+        unsigned char *out = buf + r * row_bytes;
+        if (layer == 0) {
+          /* Average each 2x2 block, as far as the picture goes. */
+          int y0 = 2 * (y + r), y1 = y0 + 1 < h ? y0 + 1 : y0;
+          for (int x = 0; x < lw; x++) {
+            int x0 = 2 * x, x1 = x0 + 1 < w ? x0 + 1 : x0;
+            int v = norm[y0*w + x0] + norm[y0*w + x1] +
+                    norm[y1*w + x0] + norm[y1*w + x1];
+            out[x / 4] |= (v >> 8) << (2 * (x % 4));
+          }
+        } else {
+          const unsigned char *src = norm + (y + r) * w;
+          for (int x = 0; x < w; x++) {
+            int q = layer == 1 ? src[x] >> 4 : src[x] & 15;
+            out[x / 2] |= q << (4 * (x % 2));
+          }
+        }
+      }
+      unsigned char header[8] = {'L', (unsigned char)w, (unsigned char)h,
+        (unsigned char)layer, (unsigned char)y, (unsigned char)rows,
+        (unsigned char)lo, (unsigned char)hi};
+      if (netSendPacket(p, header, 8, buf, rows * row_bytes) == -1)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+typedef struct {
+  unsigned char w, h;    /* 0 if the slot is empty. */
+  unsigned char pixels[TILE_SIZE * TILE_SIZE];
+} tileCacheSlot;
+
+/* Slot of a tw*th tile whose rows are 'stride' bytes apart. The key is
+ * the mean of each quarter of the tile in 16 levels, so that the noise of
+ * the camera rarely changes it. */
+int tileCacheKey(const unsigned char *px, int stride, int tw, int th) {
+  int sum[4] = {0, 0, 0, 0}, count[4] = {0, 0, 0, 0};
+  for (int y = 0; y < th; y++) {
+    for (int x = 0; x < tw; x++) {
+      int q = (y * 2 >= th) * 2 + (x * 2 >= tw);
+      sum[q] += px[y * stride + x];
+      count[q]++;
+    }
+  }
+  uint32_t key = tw << 8 | th;
+  for (int q = 0; q < 4; q++)
+    key = key << 4 ^ (count[q] ? sum[q] / count[q] >> 4 : 0);
+  return (key * 2654435761u) >> (32 - TILE_CACHE_BITS);
+}
+
+/* Put a tw*th tile, stored packed, in its slot. */
+void tileCachePut(tileCacheSlot *cache, const unsigned char *px, int tw,
+                  int th) {
+  tileCacheSlot *slot = cache + tileCacheKey(px, tw, tw, th);
+  slot->w = tw;
+  slot->h = th;
+  memcpy(slot->pixels, px, tw * th);
+}
+
+/* What the send stage knows about the picture of the peer, with
+ * --max-rate. */
+typedef struct {
+  unsigned char *sent;   /* The w*h picture as the peer has it. */
+  int w, h;
+  unsigned int gen;      /* Connection it was sent on. */
+  unsigned char owed[TILE_MAX]; /* Must be sent even if unchanged. */
+  int age[TILE_MAX];     /* Frames each changed tile has been waiting. */
+  int still[TILE_MAX];   /* Frames each tile has been the same. */
+  unsigned char *refs;   /* TILE_REFS pictures the peer keeps too, */
+  unsigned char ref_valid[TILE_MAX]; /* with a bit per reference, */
+  unsigned int ref_used[TILE_MAX][TILE_REFS]; /* and when it was used. */
+  unsigned int frames;
+  tileCacheSlot *cache;  /* The same as the one of the peer. */
+  long long credit;      /* Bytes we may send right now. */
+  long long credit_time;
+} tileEncoder;
+
+typedef struct {
+  int score, tile;
+} tileRank;
+
+int tileRankCompare(const void *a, const void *b) {
+  return ((const tileRank *)b)->score - ((const tileRank *)a)->score;
+}
+
+/* Importance of the tile at tx,ty of a cols*rows grid: 4 in the center
+ * down to 1 in the corners. */
+int tileWeight(int tx, int ty, int cols, int rows) {
+  int dx = abs(2 * tx + 1 - cols) * 16 / cols; /* 0..15 */
+  int dy = abs(2 * ty + 1 - rows) * 16 / rows;
+  return 4 - (dx + dy) * 3 / 30;
+}
+
+/* Sum of the differences above the noise between the area r of two
+ * pictures w pixels wide. */
+int tileDiff(const unsigned char *a, const unsigned char *b, int w, rect r) {
+  int diff = 0;
+  for (int y = r.y; y < r.y + r.h; y++) {
+    const unsigned char *pa = a + y * w + r.x, *pb = b + y * w + r.x;
+    for (int i = 0; i < r.w; i++) {
+      int d = abs(pa[i] - pb[i]);
+      if (d > TILE_NOISE) diff += d;
+    }
+  }
+  return diff;
+}
+
+/* Copy the area r from a picture w pixels wide to another. */
+void tileCopy(unsigned char *dst, const unsigned char *src, int w, rect r) {
+  for (int y = r.y; y < r.y + r.h; y++)
+    memcpy(dst + y * w + r.x, src + y * w + r.x, r.w);
+}
+
+/* Area of the tile t of a w*h picture. */
+rect tileArea(int t, int w, int h) {
+  int cols = (w + TILE_SIZE - 1) / TILE_SIZE;
+  int x = t % cols * TILE_SIZE, y = t / cols * TILE_SIZE;
+  return (rect){x, y, x + TILE_SIZE > w ? w - x : TILE_SIZE,
+                y + TILE_SIZE > h ? h - y : TILE_SIZE};
+}
+
+/* Send the tiles of a w*h frame that differ from what the peer has, as
+ * 'T' w h x y tw th <data>, most important first, as long as the rate
+ * allows, then 'E' if any was sent. Tiles that look like one the peer
+ * kept as a reference are restored from it with 'B' instead, or like one
+ * in the cache with 'X', and tiles that stay the same for a while are
+ * kept with 'M'. The first tile is preceded by the time the frame was
+ * 'taken'. 'buf' is scratch space of a tile. Returns -1 on error. */
+int sendTiles(struct pipeline *p, tileEncoder *te, const unsigned char *pixels,
+    int w, int h, long long taken, unsigned char *buf) {
+  long long now = current_timestamp();
+  long long rate = E.max_rate; /* KB/s are bytes per millisecond. */
+  long long burst = rate * TILE_BURST_MS;
+  if (burst < 7 + TILE_SIZE * TILE_SIZE) burst = 7 + TILE_SIZE * TILE_SIZE;
+  te->credit += (now - te->credit_time) * rate;
+  if (te->credit > burst) te->credit = burst;
+  te->credit_time = now;
+  te->frames++;
+  int lookup = atomic_load(&p->effort) == EFFORT_MAX;
+  int refs_on = lookup &&
+      (atomic_load(&p->peer_features) & NET_FEATURE_REFS);
+
+  /* A new size or connection: the peer may have anything. */
+  int cols = (w + TILE_SIZE - 1) / TILE_SIZE;
+  int rows = (h + TILE_SIZE - 1) / TILE_SIZE;
+  unsigned int gen = atomic_load(&p->link_gen);
+  if (w != te->w || h != te->h || gen != te->gen) {
+    memset(te->sent, 0, w * h);
+    memset(te->owed, 1, cols * rows);
+    memset(te->age, 0, sizeof(te->age));
+    memset(te->still, 0, sizeof(te->still));
+    memset(te->ref_valid, 0, sizeof(te->ref_valid));
+    if (gen != te->gen)
+      memset(te->cache, 0, TILE_CACHE_SLOTS * sizeof(tileCacheSlot));
+    te->w = w;
+    te->h = h;
+    te->gen = gen;
+  }
+
+  tileRank rank[TILE_MAX];
+  int count = 0, sent = 0;
+  for (int t = 0; t < cols * rows; t++) {
+    rect a = tileArea(t, w, h);
+    int diff = tileDiff(pixels, te->sent, w, a);
+    if (diff == 0 && !te->owed[t]) {
+      te->age[t] = 0;
+      if (++te->still[t] != TILE_STILL_FRAMES || !refs_on) continue;
+
+      /* Still for a while: probably background, worth keeping unless
+       * already kept. The least recently used reference makes room. */
+      int r, lru = 0;
+      for (r = 0; r < TILE_REFS; r++) {
+        if (!(te->ref_valid[t] & 1 << r)) break;
+        if (tileDiff(te->sent, te->refs + r * 255 * 255, w, a) == 0) break;
+        if (te->ref_used[t][r] < te->ref_used[t][lru]) lru = r;
+      }
+      if (r < TILE_REFS && (te->ref_valid[t] & 1 << r)) continue;
+      if (r == TILE_REFS) r = lru;
+      unsigned char keep[8] = {'M', (unsigned char)w, (unsigned char)h,
+        (unsigned char)a.x, (unsigned char)a.y, (unsigned char)a.w,
+        (unsigned char)a.h, (unsigned char)r};
+      if (netSendPacket(p, keep, 8, NULL, 0) == -1) return -1;
+      tileCopy(te->refs + r * 255 * 255, te->sent, w, a);
+      te->ref_valid[t] |= 1 << r;
+      te->ref_used[t][r] = te->frames;
+      te->credit -= 8;
+      continue;
+    }
+    te->still[t] = 0;
+    diff = te->owed[t] ? 255 : diff / (a.w * a.h) + 1;
+    rank[count].score = diff * tileWeight(t % cols, t / cols, cols, rows) +
+                        te->age[t] * TILE_AGE_WEIGHT;
+    rank[count].tile = t;
+    count++;
+  }
+  qsort(rank, count, sizeof(tileRank), tileRankCompare);
+
+  /* Once a tile doesn't fit, the rest waits too, or the small tiles at
+   * the edges would always slip in before the important ones. */
+  int full = 0;
+  for (int i = 0; i < count; i++) {
+    int t = rank[i].tile;
+    rect a = tileArea(t, w, h);
+    int r = lookup ? 0 : TILE_REFS;
+    while (r < TILE_REFS && (!(te->ref_valid[t] & 1 << r) ||
+           tileDiff(pixels, te->refs + r * 255 * 255, w, a) != 0)) r++;
+    const unsigned char *px = pixels + a.y * w + a.x;
+    int key = tileCacheKey(px, w, a.w, a.h);
+    tileCacheSlot *slot = te->cache + key;
+    int cached = lookup && r == TILE_REFS &&
+        (atomic_load(&p->peer_features) & NET_FEATURE_CACHE) &&
+        slot->w == a.w && slot->h == a.h;
+    for (int y = 0; cached && y < a.h; y++) {
+      for (int x = 0; x < a.w; x++) {
+        if (abs(px[y * w + x] - slot->pixels[y * a.w + x]) > TILE_NOISE) {
+          cached = 0;
+          break;
+        }
+      }
+    }
+    int cost = r < TILE_REFS || cached ? 8 : 7 + a.w * a.h;
+    if (full || te->credit < cost || atomic_load(&p->hangup)) {
+      te->age[t]++; /* Next time, then. */
+      full = 1;
+      continue;
+    }
+    if (sent == 0 && netSendStamp(p, taken) == -1) return -1;
+    if (r < TILE_REFS) {
+      /* Seen before: the peer has it already. */
+      unsigned char back[8] = {'B', (unsigned char)w, (unsigned char)h,
+        (unsigned char)a.x, (unsigned char)a.y, (unsigned char)a.w,
+        (unsigned char)a.h, (unsigned char)r};
+      if (netSendPacket(p, back, 8, NULL, 0) == -1) return -1;
+      tileCopy(te->sent, te->refs + r * 255 * 255, w, a);
+      te->ref_used[t][r] = te->frames;
+    } else if (cached) {
+      /* Seen somewhere, some time: the peer has it in the same slot. */
+      unsigned char hit[8] = {'X', (unsigned char)w, (unsigned char)h,
+        (unsigned char)a.x, (unsigned char)a.y, (unsigned char)a.w,
+        (unsigned char)a.h, (unsigned char)key};
+      if (netSendPacket(p, hit, 8, NULL, 0) == -1) return -1;
+      for (int y = 0; y < a.h; y++)
+        memcpy(te->sent + (a.y + y) * w + a.x, slot->pixels + y * a.w, a.w);
+    } else {
+      for (int y = 0; y < a.h; y++)
+        memcpy(buf + y * a.w, px + y * w, a.w);
+      tileCopy(te->sent, pixels, w, a);
+      tileCachePut(te->cache, buf, a.w, a.h);
+      unsigned char header[7] = {'T', (unsigned char)w, (unsigned char)h,
+        (unsigned char)a.x, (unsigned char)a.y, (unsigned char)a.w,
+        (unsigned char)a.h};
+      if (netSendPacket(p, header, 7, buf, a.w * a.h) == -1) return -1;
+    }
+    te->credit -= cost;
+    te->owed[t] = 0;
+    te->age[t] = 0;
+    sent++;
+  }
+  if (sent == 0) return 0;
+  unsigned char end[3] = {'E', (unsigned char)w, (unsigned char)h};
+  return netSendPacket(p, end, 3, NULL, 0);
+}
+
+/* Time the send stage spent on the current frame, and for how many frames
+ * it had plenty of time left. */
+typedef struct {
+  long long busy_us;
+  int calm_frames;
+} effortMeter;
+
+/* A frame was sent: pick the effort for the next one. */
+void adaptEffort(struct pipeline *p, effortMeter *m) {
+  int effort = atomic_load(&p->effort);
+  if (m->busy_us > EFFORT_FRAME_US * 3 / 4) {
+    if (effort > 0) atomic_store(&p->effort, effort - 1);
+    m->calm_frames = 0;
+  } else if (m->busy_us < EFFORT_FRAME_US / 4) {
+    if (++m->calm_frames >= EFFORT_UP_FRAMES && effort < EFFORT_MAX) {
+      atomic_store(&p->effort, effort + 1);
+      m->calm_frames = 0;
+    }
+  } else {
+    m->calm_frames = 0;
+  }
+  m->busy_us = 0;
+}
+
+/* Send stage: ship every slice to the peer as soon as it is converted, and
+ * mark the end of the frame after the last one. With --progressive slices
+ * are put back together, and the whole frame is sent in layers instead, or
+ * with --max-rate just the tiles that changed.
+ * This is also where we tell the peer which area of its picture we can't
+ * see. */
+void *sendThread(void *arg) {
+  struct pipeline *p = arg;
+  spscRing *inputs[] = {&p->outgoing};
+  unsigned long long hidden_sent = 0;
+  unsigned int gen_sent = 0;
+  unsigned int view_sent = VIEW_FULL, view_gen = 0;
+  unsigned char *frame = malloc(3 * 255 * 255);
+  tileEncoder te;
+  memset(&te, 0, sizeof(te));
+  te.sent = malloc(255 * 255);
+  te.refs = malloc(TILE_REFS * 255 * 255);
+  te.cache = calloc(TILE_CACHE_SLOTS, sizeof(tileCacheSlot));
+  effortMeter meter = {0, 0};
+  probeRamp ramp = {0, 0};
+  int dropping = 0;               /* Skipping the slices of a frame, */
+  unsigned int decided = 0;       /* and the frame that was decided for, */
+  int have_decided = 0;           /* if any. */
+  int sent_w = 0, sent_h = 0;     /* Size of the last frame sent, */
+  unsigned int sent_gen = 0;      /* on this connection. */
+  long long next_frame = 0;       /* When frameDue() lets one through. */
+
+  while (atomic_load(&p->running)) {
+    if (atomic_load(&p->hangup)) {
+      unsigned char quit_pkt[3] = {'Q', 0, 0};
+      netSendControl(p, quit_pkt, 3);
+      atomic_store(&p->running, 0);
+      break;
+    }
+
+    /* A new connection may well be a new peer: tell it again. */
+    unsigned long long hidden = atomic_load(&p->my_hidden);
+    unsigned int gen = atomic_load(&p->link_gen);
+    if (hidden != hidden_sent || gen != gen_sent) {
+      unsigned char occ_pkt[7];
+      for (int i = 0; i < 6; i++) occ_pkt[i+1] = hidden >> (8*i) & 0xff;
+      occ_pkt[0] = 'O';
+      if (netSendControl(p, occ_pkt, 7) == -1) netLinkDown(p);
+      hidden_sent = hidden;
+      gen_sent = gen;
+    }
+
+    /* Same for the part of its picture we look at, if it can crop. */
+    unsigned int view = atomic_load(&p->my_view);
+    if ((view != view_sent || gen != view_gen) &&
+        (atomic_load(&p->peer_features) & NET_FEATURE_VIEW))
+    {
+      unsigned char view_pkt[5] = {'V', view & 0xff, view >> 8 & 0xff,
+        view >> 16 & 0xff, view >> 24};
+      if (netSendControl(p, view_pkt, 5) == -1) netLinkDown(p);
+      view_sent = view;
+      view_gen = gen;
+    }
+
+    /* Probe the link once the peer said it answers. */
+    if ((atomic_load(&p->peer_features) & NET_FEATURE_PROBE) &&
+        atomic_load(&p->probe_time) == 0)
+    {
+      atomic_store(&p->probe_time, current_timestamp());
+      if (netSendProbe(p) == -1) netLinkDown(p);
+    }
+
+    ringSlot *s = ringPeek(&p->outgoing);
+    if (s == NULL) {
+      ringWait(inputs, 1, 100);
+      continue;
+    }
+    long long start = microseconds();
+    long long wait_start = thread_wait_us;
+    int last = s->y + s->rows == s->height;
+    int retval = 0;
+
+    /* Whether a frame goes out is decided once, at the first of its
+     * slices we see, and holds for all of them: the peer would otherwise
+     * draw rows of different frames. A frame whose first slice is gone
+     * already can't go out whole, and neither can one that comes while
+     * frames are held back until the peer said what it supports, or
+     * answered the probe. Late frames are skipped too, unless the peer
+     * needs them, or with layers and tiles, that pick the frames to send
+     * with frameDue() once they have them whole. */
+    if (!have_decided || s->frame != decided) {
+      int fresh = s->width != sent_w || s->height != sent_h ||
+                  gen != sent_gen;
+      have_decided = 1;
+      decided = s->frame;
+      dropping = s->y != 0 ||
+          (!(atomic_load(&p->peer_features) & NET_FEATURES_HEARD) &&
+           current_timestamp() < atomic_load(&p->link_up_time) +
+                                 NET_FEATURES_WAIT_MS) ||
+          ((atomic_load(&p->peer_features) & NET_FEATURE_PROBE) &&
+           !atomic_load(&p->probed) &&
+           current_timestamp() < atomic_load(&p->probe_time) +
+                                 NET_PROBE_WAIT_MS);
+      if (!dropping && !progressiveOn(p) && !tilesOn(p)) {
+        netWaitWritable(p, 100);
+        dropping = !s->critical && !fresh &&
+            (current_timestamp() - s->time > NET_FRAME_DEADLINE_MS ||
+             !frameDue(p, &next_frame));
+      }
+    }
+    if (dropping) {
+      ramp.wait_us += thread_wait_us - wait_start;
+      ringRelease(&p->outgoing);
+      continue;
+    }
+
+    if (progressiveOn(p) || tilesOn(p)) {
+      /* Hidden columns keep what the last frame had there, so that with
+       * tiles they don't even look changed. */
+      unsigned char *src = s->data;
+      int right = s->hide_x + s->hide_w;
+      for (int y = s->y; y < s->y + s->rows; y++) {
+        unsigned char *dst = frame + y * s->width;
+        memcpy(dst, src, s->hide_x);
+        src += s->hide_x;
+        memcpy(dst + right, src, s->width - right);
+        src += s->width - right;
+      }
+      int w = s->width, h = s->height;
+      long long taken = s->time;
+      ringRelease(&p->outgoing);
+      if (last && frameDue(p, &next_frame)) {
+        if (progressiveOn(p)) {
+          retval = netSendStamp(p, taken);
+          if (retval == 0)
+            retval = sendLayers(p, frame, w, h, frame + 255*255,
+                frame + 2*255*255);
+        } else {
+          retval = sendTiles(p, &te, frame, w, h, taken, frame + 255*255);
+        }
+      }
+    } else {
+      sent_w = s->width;
+      sent_h = s->height;
+      sent_gen = gen;
+      if (s->y == 0) retval = netSendStamp(p, s->time);
+
+      unsigned char header[7] = {'S',
+        (unsigned char)s->width,
+        (unsigned char)s->height,
+        (unsigned char)s->y,
+        (unsigned char)s->rows,
+        (unsigned char)s->hide_x,
+        (unsigned char)s->hide_w};
+      int hdrlen = 5;
+      if (s->hide_w > 0) {
+        header[0] = 'H';
+        hdrlen = 7;
+      }
+      if (retval == 0)
+        retval = netSendPacket(p, header, hdrlen, s->data, s->len);
+      if (retval == 0 && last) {
+        unsigned char end[3] = {'E', header[1], header[2]};
+        retval = netSendPacket(p, end, 3, NULL, 0);
+      }
+      ringRelease(&p->outgoing);
+    }
+    if (retval == -1) netLinkDown(p);
+
+    long long waited = thread_wait_us - wait_start;
+    meter.busy_us += microseconds() - start - waited;
+    ramp.wait_us += waited;
+    if (last) {
+      adaptEffort(p, &meter);
+      rampProbe(p, &ramp);
+    }
+  }
+  free(frame);
+  free(te.sent);
+  free(te.refs);
+  free(te.cache);
+  return NULL;
+}
 
-  // Send initial configuration to peer
-  unsigned char init_conf[3] = {'C', (unsigned char)my_w, (unsigned char)my_h};
-  write(sockfd, init_conf, 3);
+/* Hand rows y..y+rows-1 of a w*h picture to the compose stage, without
+ * the hide_w columns starting at hide_x. A 'rows' of zero marks the end of
+ * the frame. If compose is busy the slice is dropped, returning -1: the
+ * next frame will overwrite the stale rows anyway. */
+int queuePictureSlice(struct pipeline *p, int w, int h, int y, int rows,
+    int hide_x, int hide_w, unsigned char *pixels) {
+  int len = (w - hide_w) * rows;
+  ringSlot *s = ringAcquire(&p->incoming);
+  if (s == NULL || !ringSlotFit(s, len)) return -1;
+  if (len > 0) memcpy(s->data, pixels, len);
+  s->width = w;
+  s->height = h;
+  s->y = y;
+  s->rows = rows;
+  s->hide_x = hide_x;
+  s->hide_w = hide_w;
+  s->len = len;
+  ringPublish(&p->incoming);
+  return 0;
+}
 
-  long long next_frame_time = current_timestamp();
+/* What the receive stage remembers of the packets of a connection. */
+struct netInput {
+  unsigned char peer_token[NET_TOKEN_LEN];
+  int have_token;
+  lzStream lz;       /* Decompressed 'Z' packets. */
+  unsigned char *layers; /* Stretched pixels of the last frame in layers, */
+  int layers_w;          /* then the same pixels to draw. */
+  int layers_h;
+  unsigned char *tiles;  /* Picture sent in tiles, */
+  int tiles_w, tiles_h;
+  int dirty_y, dirty_end; /* and its rows not drawn yet. */
+  unsigned char *refs;   /* Tiles kept as asked with 'M'. */
+  tileCacheSlot *cache;  /* Tiles received, as the peer has them. */
+  long long probe_start; /* When the first packet of the probe came. */
+  int stale;             /* The frame coming in is too late to draw. */
+  int have_delay;        /* Shortest delay of a stamped frame, in ms, */
+  int delay_base;        /* counting the offset of the clocks. */
+  long long stale_since; /* Since when frames are late, or 0. */
+  int skipped;           /* Late frames not drawn. */
+  unsigned char *chunks[NET_STREAMS]; /* Packet being reassembled, */
+  int chunks_len[NET_STREAMS];        /* per stream. */
+};
 
-  while (1) {
-    long long now = current_timestamp();
-    long long wait_ms = next_frame_time - now;
-    if (wait_ms < 0) wait_ms = 0;
+/* Handle a tile sent with --max-rate: put it in place ('T'), keep it as
+ * a reference ('M'), restore it from one ('B') or from the cache ('X').
+ * The rows are drawn at the end of the frame: a tile that is not drawn
+ * would never be sent again. */
+void receiveTile(struct netInput *in, const unsigned char *pkt) {
+  int w = pkt[1], h = pkt[2];
+  rect a = {pkt[3], pkt[4], pkt[5], pkt[6]};
+  if (w != in->tiles_w || h != in->tiles_h) {
+    memset(in->tiles, 0, w * h);
+    in->tiles_w = w;
+    in->tiles_h = h;
+    in->dirty_y = in->dirty_end = 0;
+  }
+  if (pkt[0] == 'M') {
+    tileCopy(in->refs + pkt[7] * 255 * 255, in->tiles, w, a);
+    return;
+  } else if (pkt[0] == 'B') {
+    tileCopy(in->tiles, in->refs + pkt[7] * 255 * 255, w, a);
+  } else if (pkt[0] == 'X') {
+    tileCacheSlot *slot = in->cache + pkt[7];
+    if (slot->w != a.w || slot->h != a.h) return;
+    for (int r = 0; r < a.h; r++)
+      memcpy(in->tiles + (a.y + r) * w + a.x, slot->pixels + r * a.w, a.w);
+  } else {
+    for (int r = 0; r < a.h; r++)
+      memcpy(in->tiles + (a.y + r) * w + a.x, pkt + 7 + r * a.w, a.w);
+    tileCachePut(in->cache, pkt + 7, a.w, a.h);
+  }
+  int y = a.y, th = a.h;
+  if (in->dirty_y == in->dirty_end) {
+    in->dirty_y = y;
+    in->dirty_end = y + th;
+  } else {
+    if (y < in->dirty_y) in->dirty_y = y;
+    if (y + th > in->dirty_end) in->dirty_end = y + th;
+  }
+}
 
-    // Check for Window Resize (I am the source of truth for what I want to see)
-    if (E.screencols != my_w || E.screenrows != my_h) {
-      // Clamp
-      int new_w = E.screencols > 255 ? 255 : E.screencols;
-      int new_h = E.screenrows > 255 ? 255 : E.screenrows;
+/* A frame taken at 'stamp' by the clock of the peer is coming: decide
+ * whether it is too late to draw. */
+void noteFrameStamp(struct netInput *in, unsigned int stamp) {
+  long long now = current_timestamp();
+  int delay = (int)((unsigned int)now - stamp);
+  if (!in->have_delay || delay < in->delay_base) {
+    in->delay_base = delay;
+    in->have_delay = 1;
+  }
+  in->stale = E.max_delay > 0 && delay - in->delay_base > E.max_delay;
+  if (in->stale && in->stale_since == 0) {
+    in->stale_since = now;
+  } else if (in->stale && now - in->stale_since > E.max_delay) {
+    /* Late for too long: the link got slower, not stuck. */
+    in->delay_base = delay;
+    in->stale = 0;
+  }
+  if (in->stale) {
+    in->skipped++;
+    return;
+  }
+  if (in->skipped > 0)
+    editorSetStatusMessage("Skipped %d late frames to catch up.",
+        in->skipped);
+  in->stale_since = 0;
+  in->skipped = 0;
+}
 
-      // Update state
-      my_w = new_w;
-      my_h = new_h;
+/* Draw a layer of a frame sent with --progressive: the base replaces the
+ * whole picture, refinements the rows they carry. */
+void receiveLayer(struct pipeline *p, struct netInput *in,
+    const unsigned char *pkt) {
+  int w = pkt[1], h = pkt[2], layer = pkt[3], y = pkt[4], rows = pkt[5];
+  int lo = pkt[6], hi = pkt[7];
+  int lw, lh, row_bytes = layerGeometry(layer, w, h, &lw, &lh);
+  const unsigned char *data = pkt + 8;
+  unsigned char *norm = in->layers;
+
+  if (layer == 0) {
+    for (int yy = 0; yy < h; yy++) {
+      const unsigned char *src = data + yy / 2 * row_bytes;
+      for (int x = 0; x < w; x++)
+        norm[yy*w + x] = (src[x / 8] >> (2 * (x / 2 % 4)) & 3) * 85;
+    }
+    in->layers_w = w;
+    in->layers_h = h;
+    y = 0;
+    rows = h;
+  } else {
+    if (w != in->layers_w || h != in->layers_h) return; /* No base. */
+    for (int r = 0; r < rows; r++) {
+      const unsigned char *src = data + r * row_bytes;
+      unsigned char *dst = norm + (y + r) * w;
+      for (int x = 0; x < w; x++) {
+        int q = src[x / 2] >> (4 * (x % 2)) & 15;
+        dst[x] = layer == 1 ? q * 17 : (dst[x] & 0xf0) | q;
+      }
+    }
+  }
 
-      // Notify Peer
-      unsigned char conf_pkt[3] = {'C',
-        (unsigned char)my_w,
-        (unsigned char)my_h};
-      write(sockfd, conf_pkt, 3);
+  unsigned char *out = in->layers + 255 * 255;
+  for (int i = y * w; i < (y + rows) * w; i++)
+    out[i] = lo + (norm[i] * (hi - lo) + 127) / 255;
+  if (in->stale) return;
+  queuePictureSlice(p, w, h, y, rows, 0, 0, out + y * w);
+  if (y + rows == h) queuePictureSlice(p, w, h, h, 0, 0, 0, NULL);
+}
+
+/* Handle the packet at the start of buf. Returns its size, 0 if it is not
+ * complete yet, or -1 if it doesn't look like any packet. */
+int netHandlePacket(struct pipeline *p, struct netInput *in,
+    unsigned char *buf, int len) {
+  if (len < 3) return 0;
+  unsigned char type = buf[0];
+  int p_w = buf[1];
+  int p_h = buf[2];
+
+  int packet_size = 0;
+
+  if (type == 'C') {
+    packet_size = 3;
+    // Handle Config
+    if (p_w > 0 && p_h > 0) {
+      atomic_store(&p->peer_w, p_w);
+      atomic_store(&p->peer_h, p_h);
+    }
+  } else if (type == 'S' && len < 5) {
+    // Incomplete slice header, wait for more data
+    return 0;
+  } else if (type == 'S' && buf[4] > 0 && buf[3] + buf[4] <= p_h) {
+    int y = buf[3];
+    int rows = buf[4];
+    packet_size = 5 + (p_w * rows);
+    if (len < packet_size) return 0;
+    if (!in->stale) queuePictureSlice(p, p_w, p_h, y, rows, 0, 0, buf + 5);
+  } else if (type == 'H' && len < 7) {
+    // Incomplete slice header, wait for more data
+    return 0;
+  } else if (type == 'H' && buf[4] > 0 &&
+             buf[3] + buf[4] <= p_h &&
+             buf[5] + buf[6] <= p_w) {
+    int y = buf[3];
+    int rows = buf[4];
+    int hide_x = buf[5];
+    int hide_w = buf[6];
+    packet_size = 7 + ((p_w - hide_w) * rows);
+    if (len < packet_size) return 0;
+    if (!in->stale)
+      queuePictureSlice(p, p_w, p_h, y, rows, hide_x, hide_w, buf + 7);
+  } else if (type == 'O' && len < 7) {
+    // Incomplete hidden area report, wait for more data
+    return 0;
+  } else if (type == 'O') {
+    packet_size = 7;
+    unsigned long long hidden = 0;
+    for (int i = 0; i < 6; i++)
+      hidden |= (unsigned long long)buf[i+1] << (8*i);
+    atomic_store(&p->peer_hidden, hidden);
+  } else if (type == 'V' && len < 5) {
+    // Incomplete view request, wait for more data
+    return 0;
+  } else if (type == 'V') {
+    packet_size = 5;
+    if (buf[3] > 0 && buf[4] > 0 && buf[1] + buf[3] <= 255 &&
+        buf[2] + buf[4] <= 255) {
+      atomic_store(&p->peer_view, (unsigned int)buf[1] | buf[2] << 8 |
+          buf[3] << 16 | (unsigned int)buf[4] << 24);
+    }
+  } else if (type == 'R' && len < 1 + NET_TOKEN_LEN) {
+    // Incomplete session token, wait for more data
+    return 0;
+  } else if (type == 'R') {
+    // A new connection: the same peer again, or someone else
+    packet_size = 1 + NET_TOKEN_LEN;
+    if (in->have_token &&
+        memcmp(in->peer_token, buf + 1, NET_TOKEN_LEN) == 0) {
+      if (p->crypto.on) {
+        editorSetStatusMessage("Reconnected, security code %s: "
+            "check it matches your peer's", p->crypto.code);
+      } else {
+        editorSetStatusMessage("Reconnected.");
+      }
+    } else if (in->have_token) {
+      atomic_store(&p->peer_hidden, 0);
+      atomic_store(&p->peer_view, VIEW_FULL);
+      editorSetStatusMessage("Connected to a new peer.");
+    }
+    memcpy(in->peer_token, buf + 1, NET_TOKEN_LEN);
+    in->have_token = 1;
+  } else if ((type == 'I' || type == 'J' || type == 'D' || type == 'A') &&
+             len < 5) {
+    // Incomplete probe packet, wait for more data
+    return 0;
+  } else if (type == 'I') {
+    // Ping: echo the clock of the peer back
+    packet_size = 5;
+    unsigned char echo_pkt[5] = {'J', buf[1], buf[2], buf[3], buf[4]};
+    if (netSendControl(p, echo_pkt, 5) == -1) netLinkDown(p);
+  } else if (type == 'J') {
+    packet_size = 5;
+    unsigned int sent = buf[1] | buf[2] << 8 | buf[3] << 16 |
+                        (unsigned int)buf[4] << 24;
+    atomic_store(&p->rtt_ms, (unsigned int)current_timestamp() - sent);
+    atomic_store(&p->pong_time, current_timestamp());
+  } else if (type == 'U') {
+    // Probe train: time it from the first packet to the last
+    packet_size = NET_PROBE_BYTES;
+    if (len < packet_size) return 0;
+    if (p_w == 0) {
+      in->probe_start = microseconds();
+    } else if (p_w == p_h - 1) {
+      long long elapsed = microseconds() - in->probe_start;
+      unsigned int bps = NET_PROBE_FAST;
+      if (elapsed >= 1000)
+        bps = (long long)p_w * NET_PROBE_BYTES * 1000000 / elapsed;
+      unsigned char rate_pkt[5] = {'D', bps & 0xff, bps >> 8 & 0xff,
+        bps >> 16 & 0xff, bps >> 24};
+      if (netSendControl(p, rate_pkt, 5) == -1) netLinkDown(p);
+    }
+  } else if (type == 'D') {
+    packet_size = 5;
+    netApplyProbe(p, buf[1] | buf[2] << 8 | buf[3] << 16 |
+        (unsigned int)buf[4] << 24);
+  } else if (type == 'A') {
+    packet_size = 5;
+    noteFrameStamp(in, buf[1] | buf[2] << 8 | buf[3] << 16 |
+        (unsigned int)buf[4] << 24);
+  } else if (type == 'Q') {
+    editorSetStatusMessage("Call ended by peer.");
+    atomic_store(&p->running, 0);
+    packet_size = 3;
+  } else if (type == 'F') {
+    packet_size = 3;
+    atomic_store(&p->peer_features, p_w | p_h << 8 | NET_FEATURES_HEARD);
+  } else if (type == 'Z') {
+    // A compressed packet: decompress it and handle what it was
+    packet_size = 3 + (p_w << 8 | p_h);
+    if (len < packet_size) return 0;
+    unsigned char *inner;
+    int inner_len = lzDecompress(&in->lz, buf + 3, packet_size - 3, &inner);
+    if (inner_len > 0 && inner[0] != 'Z' && inner[0] != 'N')
+      netHandlePacket(p, in, inner, inner_len);
+  } else if (type == 'N' && len < 4) {
+    // Incomplete chunk header, wait for more data
+    return 0;
+  } else if (type == 'N') {
+    // A chunk of a packet: handle it once it is whole
+    int stream = p_w & 127, size = p_h << 8 | buf[3];
+    packet_size = 4 + size;
+    if (len < packet_size) return 0;
+    if (stream >= NET_STREAMS) return packet_size; /* Not for us. */
+    unsigned char *pkt = in->chunks[stream];
+    int *pkt_len = &in->chunks_len[stream];
+    if (*pkt_len + size > NET_PACKET_MAX) *pkt_len = 0; /* Garbled. */
+    memcpy(pkt + *pkt_len, buf + 4, size);
+    *pkt_len += size;
+    if (p_w & 128) {
+      if (*pkt_len > 0 && pkt[0] != 'N') netHandlePacket(p, in, pkt, *pkt_len);
+      *pkt_len = 0;
+    }
+  } else if (type == 'L' && len < 8) {
+    // Incomplete layer header, wait for more data
+    return 0;
+  } else if (type == 'L') {
+    int lw, lh, row_bytes = layerGeometry(buf[3], p_w, p_h, &lw, &lh);
+    // The base layer always comes whole
+    if (p_w == 0 || buf[3] >= LAYER_COUNT || buf[5] == 0 ||
+        buf[4] + buf[5] > lh || buf[6] > buf[7] ||
+        (buf[3] == 0 && buf[5] != lh)) return -1;
+    packet_size = 8 + buf[5] * row_bytes;
+    if (len < packet_size) return 0;
+    receiveLayer(p, in, buf);
+  } else if (type == 'T' && len < 7) {
+    // Incomplete tile header, wait for more data
+    return 0;
+  } else if (type == 'T' && buf[5] > 0 && buf[6] > 0 &&
+             buf[3] + buf[5] <= p_w && buf[4] + buf[6] <= p_h) {
+    packet_size = 7 + buf[5] * buf[6];
+    if (len < packet_size) return 0;
+    receiveTile(in, buf);
+  } else if ((type == 'M' || type == 'B' || type == 'X') && len < 8) {
+    // Incomplete reference header, wait for more data
+    return 0;
+  } else if ((type == 'M' || type == 'B' || type == 'X') &&
+             buf[5] > 0 && buf[6] > 0 &&
+             buf[3] + buf[5] <= p_w && buf[4] + buf[6] <= p_h &&
+             (type == 'X' || buf[7] < TILE_REFS)) {
+    packet_size = 8;
+    receiveTile(in, buf);
+  } else if (type == 'E' && in->stale) {
+    // Late: its tiles wait for the next frame to be drawn
+    packet_size = 3;
+  } else if (type == 'E') {
+    packet_size = 3;
+    if (in->dirty_end > in->dirty_y && p_w == in->tiles_w &&
+        p_h == in->tiles_h &&
+        queuePictureSlice(p, p_w, p_h, in->dirty_y,
+            in->dirty_end - in->dirty_y, 0, 0,
+            in->tiles + in->dirty_y * p_w) == 0)
+    {
+      in->dirty_y = in->dirty_end = 0;
+    }
+    queuePictureSlice(p, p_w, p_h, p_h, 0, 0, 0, NULL);
+  } else if (type == 'P') {
+    // Whole picture, as sent by peers that don't slice frames
+    packet_size = 3 + (p_w * p_h);
+    if (len < packet_size) return 0;
+    queuePictureSlice(p, p_w, p_h, 0, p_h, 0, 0, buf + 3);
+    queuePictureSlice(p, p_w, p_h, p_h, 0, 0, 0, NULL);
+  } else {
+    return -1;
+  }
+  return packet_size;
+}
+
+/* Receive stage: parse packets from the peer, hand pictures to compose. */
+void *receiveThread(void *arg) {
+  struct pipeline *p = arg;
+  unsigned char *recv_buffer = malloc(132000); // 2 * max frame + safety
+  int recv_len = 0;
+  struct netInput in;
+  in.have_token = 0;
+  lzInit(&in.lz, 0);
+  in.layers = malloc(2 * 255 * 255);
+  in.layers_w = in.layers_h = 0;
+  in.tiles = malloc(255 * 255);
+  in.tiles_w = in.tiles_h = 0;
+  in.refs = malloc(TILE_REFS * 255 * 255);
+  in.cache = calloc(TILE_CACHE_SLOTS, sizeof(tileCacheSlot));
+  in.dirty_y = in.dirty_end = 0;
+  in.probe_start = 0;
+  in.stale = in.have_delay = in.skipped = 0;
+  in.stale_since = 0;
+  for (int i = 0; i < NET_STREAMS; i++) {
+    in.chunks[i] = malloc(NET_PACKET_MAX);
+    in.chunks_len[i] = 0;
+  }
+
+  while (atomic_load(&p->running)) {
+    // Keep off the socket while the main thread replaces it. Telling it
+    // which link we let go of, as it may already be up again
+    unsigned int gen = atomic_load(&p->link_gen);
+    int link = atomic_load(&p->link);
+    if (link != LINK_UP) {
+      if (link == LINK_DOWN) atomic_store(&p->rx_parked, gen);
+      recv_len = 0; // Half a packet from the old connection
+      lzReset(&in.lz);
+      in.stale = in.have_delay = 0; // Maybe another clock
+      for (int i = 0; i < NET_STREAMS; i++) in.chunks_len[i] = 0;
+      struct timespec ts = {0, 20000000};
+      nanosleep(&ts, NULL);
+      continue;
     }
 
     fd_set readfds;
     FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
-    FD_SET(sockfd, &readfds);
+    FD_SET(p->sockfd, &readfds);
+    struct timeval tv = {0, 100000};
+    if (!netPending(p) &&
+        select(p->sockfd + 1, &readfds, NULL, NULL, &tv) <= 0) continue;
+
+    int n = netRead(p, recv_buffer + recv_len, 131000 - recv_len);
+    if (n == 0) {
+      // Connection closed
+      editorSetStatusMessage("Connection closed by peer.");
+      netLinkDown(p);
+      continue;
+    } else if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR) continue;
+      editorSetStatusMessage("Connection error: %s", strerror(errno));
+      netLinkDown(p);
+      continue;
+    }
+    recv_len += n;
 
-    int maxfd = (sockfd > STDIN_FILENO) ? sockfd : STDIN_FILENO;
+    // Process all complete packets in buffer
+    while (recv_len >= 3 && atomic_load(&p->running)) {
+      int packet_size = netHandlePacket(p, &in, recv_buffer, recv_len);
+      if (packet_size == 0) {
+        // Incomplete packet, wait for more data
+        break;
+      } else if (packet_size == -1) {
+        // Unknown packet / Desync?
+        // Recover by skipping 1 byte (ugly but "robust" enough for a toy)
+        packet_size = 1;
+      }
 
-    struct timeval tv;
-    tv.tv_sec = wait_ms / 1000;
-    tv.tv_usec = (wait_ms % 1000) * 1000;
+      // Remove the processed packet from the buffer
+      recv_len -= packet_size;
+      if (recv_len > 0) {
+        memmove(recv_buffer, recv_buffer + packet_size, recv_len);
+      }
+    }
+  }
 
-    int activity = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+  free(recv_buffer);
+  lzFree(&in.lz);
+  free(in.layers);
+  free(in.tiles);
+  free(in.refs);
+  free(in.cache);
+  for (int i = 0; i < NET_STREAMS; i++) free(in.chunks[i]);
+  atomic_store(&p->running, 0);
+  return NULL;
+}
 
-    // Handle User Input
-    if (activity > 0 && FD_ISSET(STDIN_FILENO, &readfds)) {
-      char c;
-      if (read(STDIN_FILENO, &c, 1) == 1) {
-        if (c == CTRL_C) break;
-        if (c == 'v' || c == 'V') {
-          E.view_mode = (E.view_mode == VIEW_PIP) ? VIEW_SPLIT : VIEW_PIP;
-          if (last_peer_w > 0)
-            redrawNetworkView(cam, last_peer_pixels, last_peer_w, last_peer_h);
-        }
+/* Keep a private copy of the newest picture in 'ring', so that we can
+ * redraw it later. Returns 1 if there was a new picture. */
+int takeLatestPicture(spscRing *ring, unsigned char *pixels, int *w, int *h,
+                      int *min, int *max) {
+  ringSlot *s = ringPeekLatest(ring);
+  if (s == NULL) return 0;
+  memcpy(pixels, s->data, s->width * s->height);
+  *w = s->width;
+  *h = s->height;
+  *min = s->min;
+  *max = s->max;
+  ringRelease(ring);
+  return 1;
+}
+
+/* State of the compose stage: the peer picture is assembled here slice by
+ * slice, and drawn with the range of the last complete frame so that a
+ * half received frame doesn't change the brightness of the other half. */
+struct composer {
+  unsigned char *peer_pixels;
+  int peer_w, peer_h;
+  int peer_min, peer_max;
+  rangeLock peer_lock;
+  unsigned char *self_pixels;
+  int self_w, self_h;
+  int self_min, self_max;
+  rangeLock self_lock;
+  cellGrid back;     /* What we want on screen. */
+  cellGrid front;    /* What the terminal shows. */
+  int stale;         /* Front grid no longer matches the terminal. */
+  samplingTable peer_map;
+  samplingTable self_map;
+  struct abuf out;   /* Escape sequences, reused from update to update. */
+  char status[sizeof(E.statusmsg)]; /* Status line shown. */
+  unsigned long long hidden; /* Peer picture area covered by the self view. */
+};
+
+/* Apply the pending slices to the peer picture. Returns 1 if any. */
+int takePictureSlices(struct composer *c, spscRing *ring) {
+  ringSlot *s;
+  int count = 0;
+  while ((s = ringPeek(ring)) != NULL) {
+    if (s->width != c->peer_w || s->height != c->peer_h) {
+      c->peer_w = s->width;
+      c->peer_h = s->height;
+      memset(c->peer_pixels, 0, c->peer_w * c->peer_h);
+    }
+    if (s->rows == 0) {
+      /* Frame complete: from now on draw it with its own range. */
+      pictureRange(c->peer_pixels, c->peer_w, c->peer_h,
+          &c->peer_min, &c->peer_max);
+      rangeLockApply(&c->peer_lock, &c->peer_min, &c->peer_max);
+    } else if (s->hide_w == 0) {
+      memcpy(c->peer_pixels + s->y * c->peer_w, s->data, s->len);
+    } else {
+      /* The hidden columns keep whatever they had. */
+      unsigned char *src = s->data;
+      int right = s->hide_x + s->hide_w;
+      for (int y = s->y; y < s->y + s->rows; y++) {
+        unsigned char *dst = c->peer_pixels + y * c->peer_w;
+        memcpy(dst, src, s->hide_x);
+        src += s->hide_x;
+        memcpy(dst + right, src, c->peer_w - right);
+        src += c->peer_w - right;
       }
     }
+    ringRelease(ring);
+    count++;
+  }
+  return count > 0;
+}
 
-    // Handle Network Receive
-    if (activity > 0 && FD_ISSET(sockfd, &readfds)) {
-      int n = read(sockfd, recv_buffer + recv_len,
-          131000 - recv_len);
-      if (n == 0) {
-        // Connection closed
-        editorSetStatusMessage("Connection closed by peer.");
-        break;
-      } else if (n > 0) {
-        recv_len += n;
-
-        // Process all complete packets in buffer
-        while (recv_len >= 3) {
-          unsigned char type = recv_buffer[0];
-          int p_w = recv_buffer[1];
-          int p_h = recv_buffer[2];
-
-          int packet_size = 0;
-
-          if (type == 'C') {
-            packet_size = 3;
-            if (recv_len >= packet_size) {
-              // Handle Config
-              if (p_w > 0 && p_h > 0) {
-                peer_w = p_w;
-                peer_h = p_h;
-              }
-            }
-          } else if (type == 'P') {
-            packet_size = 3 + (p_w * p_h);
-            if (recv_len >= packet_size) {
-              // Handle Picture
-              last_peer_w = p_w;
-              last_peer_h = p_h;
-              memcpy(last_peer_pixels, recv_buffer + 3, p_w * p_h);
-              redrawNetworkView(cam, last_peer_pixels,
-                  last_peer_w, last_peer_h);
-            } else {
-              // Incomplete picture packet, wait for more data
-              break;
-            }
-          } else {
-            // Unknown packet / Desync?
-            // Recover by skipping 1 byte (ugly but "robust" enough for a toy)
-            memmove(recv_buffer, recv_buffer + 1, recv_len - 1);
-            recv_len--;
-            continue;
-          }
+/* While the window is being dragged to a new size, just repaint the whole
+ * screen scaled to whatever size it has right now, without touching the
+ * grids: they are rebuilt once, when the size settles. */
+void composeScaledView(struct composer *c, struct abuf *ab) {
+  rect peer_r, self_r;
+  currentLayout(&peer_r, &self_r);
 
-          // If we processed a packet, remove it from buffer
-          if (packet_size > 0 && recv_len >= packet_size) {
-            recv_len -= packet_size;
-            if (recv_len > 0) {
-              memmove(recv_buffer, recv_buffer + packet_size, recv_len);
-            }
-          } else {
-            // Incomplete packet (should have been caught above, but safety)
-            break;
-          }
+  abAppend(ab,"\x1b[?25l",6); /* Hide cursor. */
+  abAppend(ab,"\x1b[H",3); /* Go home. */
+  renderBuffer(ab, c->peer_pixels, c->peer_w, c->peer_h,
+      peer_r.x, peer_r.y, peer_r.w, peer_r.h, 1);
+  if (c->self_w > 0) {
+    renderBuffer(ab, c->self_pixels, c->self_w, c->self_h,
+        self_r.x, self_r.y, self_r.w, self_r.h, 1);
+  }
+  renderStatus(ab);
+  c->stale = 1;
+}
+
+/* Render the peer picture and our self view into the back grid, and emit
+ * the difference with the front grid into 'ab'. */
+void composeNetworkView(struct composer *c, struct abuf *ab) {
+  int rows = atomic_load(&E.screenrows), cols = atomic_load(&E.screencols);
+  if (rows < 0) rows = 0;
+
+  /* Screen size settled, or we drew outside of the grids while it was
+   * changing: rebuild everything that depends on it, just once. */
+  if (c->stale || rows != c->back.rows || cols != c->back.cols) {
+    gridResize(&c->back, rows, cols);
+    gridResize(&c->front, rows, cols);
+    abReset(ab, rows * cols * 4 + rows * 16 + 256);
+    c->status[0] = '\0';
+    c->stale = 0;
+    abAppend(ab, "\x1b[?25l", 6); /* Hide cursor. */
+    abAppend(ab, "\x1b[2J", 4);   /* Clear screen. */
+  }
+
+  rect peer_r, self_r;
+  computeLayout(atomic_load(&E.view_mode), cols, rows, &peer_r, &self_r);
+
+  gridInvalidate(&c->back);
+  samplingTableUpdate(&c->peer_map, c->peer_w, c->peer_h, peer_r, 1);
+  gridRenderPicture(&c->back, c->peer_pixels, &c->peer_map,
+      c->peer_min, c->peer_max);
+  rect hidden = {0, 0, 0, 0};
+  if (c->self_w > 0) {
+    int min = c->self_min, max = c->self_max;
+    rangeLockApply(&c->self_lock, &min, &max);
+    samplingTableUpdate(&c->self_map, c->self_w, c->self_h, self_r, 1);
+    gridRenderPicture(&c->back, c->self_pixels, &c->self_map, min, max);
+    if (!coveredPictureArea(peer_r, self_r, c->peer_w, c->peer_h, &hidden))
+      hidden = (rect){0, 0, 0, 0};
+  }
+  c->hidden = packHiddenArea(c->peer_w, c->peer_h, hidden);
+  gridEmit(ab, &c->back, &c->front);
+
+  /* The status line is redrawn only when it changes. */
+  char status[sizeof(E.statusmsg)];
+  editorGetStatusMessage(status, sizeof(status));
+  if (strcmp(status, c->status) != 0) {
+    renderStatus(ab);
+    memcpy(c->status, status, sizeof(status));
+  }
+}
+
+/* Compose stage: turn the latest peer picture and self view into the
+ * escape sequences that update the screen. */
+void *composeThread(void *arg) {
+  struct pipeline *p = arg;
+  spscRing *inputs[] = {&p->incoming, &p->selfview};
+
+  struct composer c;
+  memset(&c, 0, sizeof(c));
+  c.peer_pixels = calloc(65536, 1);
+  c.self_pixels = malloc(65536);
+  c.peer_max = 255;
+  int dirty = 0;
+
+  while (atomic_load(&p->running)) {
+    dirty |= takePictureSlices(&c, &p->incoming);
+    dirty |= takeLatestPicture(&p->selfview, c.self_pixels,
+        &c.self_w, &c.self_h, &c.self_min, &c.self_max);
+    dirty |= atomic_exchange(&p->redraw, 0);
+
+    /* Nothing to show until the peer sends its first picture. When the
+     * tty stage is still busy with older updates we keep the pictures and
+     * retry shortly, so that only the latest state gets drawn. */
+    if (dirty && c.peer_w > 0) {
+      ringSlot *out = ringAcquire(&p->tty);
+      if (out) {
+        abReset(&c.out, 0);
+        if (atomic_load(&p->resizing)) {
+          composeScaledView(&c, &c.out);
+        } else {
+          composeNetworkView(&c, &c.out);
+        }
+        if (c.hidden != atomic_load(&p->my_hidden)) {
+          /* The send stage tells the peer. */
+          atomic_store(&p->my_hidden, c.hidden);
+          ringWake(&p->outgoing);
+        }
+        /* With --vt-check the screen we meant to draw travels along with
+         * the escape sequences, for the tty stage to verify. */
+        int grid_len = 0;
+        if (E.vt_check && !c.stale) grid_len = c.back.rows * c.back.cols;
+        if (c.out.len > 0 && ringSlotFit(out, c.out.len + grid_len)) {
+          memcpy(out->data, c.out.b, c.out.len);
+          memcpy(out->data + c.out.len, c.back.cells, grid_len);
+          out->len = c.out.len;
+          out->width = grid_len ? c.back.cols : 0;
+          out->height = grid_len ? c.back.rows : 0;
+          ringPublish(&p->tty);
         }
+        dirty = 0;
       }
     }
 
-    // Send Frame (Rate Limited)
-    now = current_timestamp();
-    if (now >= next_frame_time) {
-      frame frame;
-      if (cameraGetFrame(cam, &frame)) {
-        // Prepare Buffer for Resize (using peer's requested dimensions)
-        int w = peer_w;
-        int h = peer_h;
-        int size = w * h;
+    ringWait(inputs, 2, dirty ? 5 : 100);
+  }
 
-        unsigned char header[3] = {'P', (unsigned char)w, (unsigned char)h};
+  gridFree(&c.back);
+  gridFree(&c.front);
+  samplingTableFree(&c.peer_map);
+  samplingTableFree(&c.self_map);
+  abFree(&c.out);
+  free(c.peer_pixels);
+  free(c.self_pixels);
+  return NULL;
+}
 
-        for (int y = 0; y < h; y++) {
-          for (int x = 0; x < w; x++) {
-            int ix = (x * frame.width) / w;
-            int iy = (y * frame.height) / h;
-            int offset = (iy * frame.width + ix) * 4;
+/* Feed an update to the virtual terminal, and check that it shows the
+ * screen compose wanted to draw, if it came along. */
+void vtCheckUpdate(vtModel *vt, ringSlot *s) {
+  /* The real terminal reflows its content on resize, compose clears it
+   * after relayout: just start over with a blank model. */
+  if (s->height > 0 && (vt->rows != s->height + 1 || vt->cols != s->width))
+    vtInit(vt, s->height + 1, s->width);
+
+  vtFeed(vt, s->data, s->len);
+  vt->updates++;
+  if (s->len > vt->max_bytes) vt->max_bytes = s->len;
+  if (s->height > 0) {
+    cellGrid want = {s->height, s->width, s->data + s->len};
+    vtCompare(vt, &want);
+  }
+}
 
-            unsigned char b = frame.pixels[offset + 0];
-            unsigned char g = frame.pixels[offset + 1];
-            unsigned char r = frame.pixels[offset + 2];
+/* TTY write stage: flush composed screens to the terminal, in order. */
+void *ttyThread(void *arg) {
+  struct pipeline *p = arg;
+  spscRing *inputs[] = {&p->tty};
 
-            net_buffer[y * w + x] = (r*77 + g*150 + b*29) >> 8;
-          }
+  while (atomic_load(&p->running)) {
+    ringSlot *s = ringPeek(&p->tty);
+    if (s == NULL) {
+      ringWait(inputs, 1, 100);
+      continue;
+    }
+    writeAll(p, STDOUT_FILENO, s->data, s->len);
+    if (E.vt_check) {
+      vtCheckUpdate(&p->vt, s);
+      if (p->vt.error[0]) atomic_store(&p->running, 0);
+    }
+    ringRelease(&p->tty);
+  }
+  return NULL;
+}
+
+void runNetworkMode(camera *cam) {
+  struct pipeline p;
+  spscRing *rings[] = {&p.capture, &p.outgoing, &p.selfview,
+    &p.incoming, &p.tty};
+  int nrings = sizeof(rings) / sizeof(rings[0]);
+
+  // Establish Connection
+  int infd, outfd, listen_fd = -1;
+  if (E.net_role == NET_ROLE_SERVER) {
+    infd = outfd = tcpListen(E.net_port, &listen_fd);
+  } else if (E.net_role == NET_ROLE_CLIENT) {
+    infd = outfd = tcpConnect(E.net_ip, E.net_port);
+  } else {
+    infd = E.stdio_fds[0];
+    outfd = E.stdio_fds[1];
+  }
+  signal(SIGPIPE, SIG_IGN); /* Write errors tell us the link broke. */
+
+  initTerminal();
+
+  p.cam = cam;
+  pthread_mutex_init(&p.send_lock, NULL);
+  pthread_mutex_init(&p.control_lock, NULL);
+  p.control_len = 0;
+  atomic_init(&p.running, 1);
+  atomic_init(&p.link, LINK_DOWN);
+  atomic_init(&p.link_gen, 0);
+  atomic_init(&p.rx_parked, 0);
+  atomic_init(&p.setup_result, 0);
+  p.setup_fd = -1;
+  atomic_init(&p.hangup, 0);
+  atomic_init(&p.effort, EFFORT_MAX);
+  atomic_init(&p.link_up_time, 0);
+  memset(&p.crypto, 0, sizeof(p.crypto));
+  lzInit(&p.lz, 1);
+  p.lz_out = malloc(LZ_MAX_BLOCK);
+  if (randomBytes(p.token, NET_TOKEN_LEN) == -1) {
+    perror("/dev/urandom");
+    exit(1);
+  }
+  if (netLinkUp(&p, infd, outfd) == -1) {
+    fprintf(stderr, "Key exchange failed: does the peer use --encrypt?\n");
+    exit(1);
+  }
+  if (E.encrypt) {
+    editorSetStatusMessage("Encrypted call, security code %s: "
+        "check it matches your peer's", p.crypto.code);
+  }
+  atomic_init(&p.redraw, 0);
+  atomic_init(&p.resizing, 0);
+  memset(&p.vt, 0, sizeof(p.vt));
+  atomic_init(&p.peer_hidden, 0);
+  atomic_init(&p.my_hidden, 0);
+  atomic_init(&p.peer_view, VIEW_FULL);
+  atomic_init(&p.my_view, VIEW_FULL);
+  atomic_init(&p.probe_time, 0);
+  atomic_init(&p.probed, 0);
+  atomic_init(&p.rtt_ms, 0);
+  atomic_init(&p.pong_time, 0);
+  atomic_init(&p.send_scale, 1);
+  atomic_init(&p.send_fps, PROBE_MAX_FPS);
+  atomic_init(&p.send_layers, LAYER_COUNT);
+  ringInit(&p.capture, 4);
+  ringInit(&p.outgoing, 2 * NET_SLICES);
+  ringInit(&p.selfview, 4);
+  ringInit(&p.incoming, 4 * NET_SLICES);
+  ringInit(&p.tty, 4);
+
+  // State: Resolution I want to receive (My peer viewport)
+  int my_w, my_h;
+  wantedPeerResolution(&my_w, &my_h);
+
+  // State: Resolution Peer wants to receive (Their Terminal)
+  // Default to 80x60 until we hear otherwise
+  atomic_init(&p.peer_w, 80);
+  atomic_init(&p.peer_h, 60);
+
+  // Send initial configuration to peer
+  netSendConfig(&p, my_w, my_h);
+
+  void *(*stages[])(void *) = {captureThread, convertThread, sendThread,
+    receiveThread, composeThread, ttyThread};
+  int nstages = sizeof(stages) / sizeof(stages[0]);
+  pthread_t threads[nstages];
+  for (int i = 0; i < nstages; i++) {
+    if (pthread_create(&threads[i], NULL, stages[i], &p) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  // State: When the window size is considered settled, 0 if not resizing
+  long long resize_settle_time = 0;
+
+  // State: Connection being dialed, or accepted, to replace a broken one
+  tcpDialer dialer;
+  int dialing = 0, next_fd = -1;
+  long long next_dial_time = 0, next_fd_time = 0;
+  pthread_t link_thread;
+  int linking = 0;
+
+  /* The main thread handles the keyboard, window size changes, and
+   * replaces the connection when it breaks. */
+  while (atomic_load(&p.running)) {
+    long long now = current_timestamp();
+    if (linking && atomic_load(&p.setup_result) != 1) {
+      // The new connection is up, or not
+      pthread_join(link_thread, NULL);
+      linking = 0;
+      if (atomic_load(&p.setup_result) == -1) {
+        close(p.setup_fd);
+        editorSetStatusMessage("Key exchange failed, reconnecting...");
+      } else {
+        netSendConfig(&p, my_w, my_h);
+      }
+    }
+
+    if (atomic_load(&p.link) == LINK_DOWN && !linking &&
+        atomic_load(&p.rx_parked) == atomic_load(&p.link_gen)) {
+      // Nobody uses the socket any more
+      if (p.sockfd != -1) {
+        pthread_mutex_lock(&p.send_lock);
+        close(p.sockfd);
+        p.sockfd = p.outfd = -1;
+        pthread_mutex_unlock(&p.send_lock);
+      }
+      if (next_fd != -1) {
+        // Keys are exchanged on another thread, keeping the keyboard on
+        p.setup_fd = next_fd;
+        next_fd = -1;
+        atomic_store(&p.setup_result, 1);
+        atomic_store(&p.link, LINK_SETUP);
+        linking = pthread_create(&link_thread, NULL, linkThread, &p) == 0;
+        if (!linking) {
+          close(p.setup_fd);
+          atomic_store(&p.link, LINK_DOWN);
         }
+      } else if (E.net_role == NET_ROLE_CLIENT && !dialing &&
+                 now >= next_dial_time) {
+        char err[128];
+        dialing = dialStart(&dialer, E.net_ip, E.net_port, err,
+            sizeof(err)) == 0;
+        if (!dialing) editorSetStatusMessage("Can't resolve %s: %s",
+            E.net_ip, err);
+        next_dial_time = now + NET_REDIAL_MS;
+      }
+    }
+
+    if (atomic_load(&p.link) == LINK_UP && next_fd != -1) {
+      // Accepted while the call is up: is the peer still there?
+      int pings = atomic_load(&p.peer_features) & NET_FEATURE_PROBE;
+      if (atomic_load(&p.pong_time) >= next_fd_time || !pings) {
+        close(next_fd);
+        next_fd = -1;
+      } else if (now >= next_fd_time + NET_LIVENESS_MS) {
+        netLinkDown(&p);
+      }
+    }
+
+    if (resize_settle_time && now >= resize_settle_time) {
+      resize_settle_time = 0;
+      atomic_store(&p.resizing, 0);
+      atomic_store(&p.redraw, 1);
+      ringWake(&p.incoming);
+    }
+
+    // Check for Window Resize or view toggle (I am the source of truth
+    // for what I want to see). Not while the window is being dragged: the
+    // peer would restart encoding at every intermediate size.
+    int new_w, new_h;
+    wantedPeerResolution(&new_w, &new_h);
+    if (!resize_settle_time && (new_w != my_w || new_h != my_h)) {
+      // Update state
+      my_w = new_w;
+      my_h = new_h;
+
+      // Notify Peer
+      netSendConfig(&p, my_w, my_h);
+    }
+
+    fd_set readfds, writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    FD_SET(STDIN_FILENO, &readfds);
+    FD_SET(E.winch_pipe[0], &readfds);
+    int maxfd = E.winch_pipe[0] > STDIN_FILENO ? E.winch_pipe[0] :
+                                                 STDIN_FILENO;
+    if (listen_fd != -1 && next_fd == -1) {
+      FD_SET(listen_fd, &readfds);
+      if (listen_fd > maxfd) maxfd = listen_fd;
+    }
+    long long wait_ms = 100;
+    if (resize_settle_time && resize_settle_time - now < wait_ms)
+      wait_ms = resize_settle_time - now;
+    if (dialing) dialFdSet(&dialer, &writefds, &maxfd, &wait_ms);
+    struct timeval tv = {0, wait_ms * 1000};
+
+    if (select(maxfd + 1, &readfds, &writefds, NULL, &tv) <= 0) continue;
+
+    // Someone dialed us: maybe the peer again, that knows the old
+    // connection is dead even if we didn't notice yet
+    if (listen_fd != -1 && FD_ISSET(listen_fd, &readfds)) {
+      if (next_fd != -1) close(next_fd);
+      next_fd = accept(listen_fd, NULL, NULL);
+      next_fd_time = current_timestamp();
+      if (next_fd != -1 && atomic_load(&p.link) == LINK_UP)
+        netSendPing(&p);
+    }
+
+    // Dialing is over when an address answers, or none does
+    if (dialing) {
+      int sock = dialCheck(&dialer, &writefds);
+      if (sock >= 0) {
+        if (next_fd != -1) close(next_fd);
+        next_fd = sock;
+      } else if (sock == -2) dialStop(&dialer);
+      dialing = sock == -1;
+    }
+
+    // Handle Window Resize: keep drawing scaled until it settles
+    if (FD_ISSET(E.winch_pipe[0], &readfds) && handleWindowResize()) {
+      resize_settle_time = current_timestamp() + RESIZE_SETTLE_MS;
+      atomic_store(&p.resizing, 1);
+      atomic_store(&p.redraw, 1);
+      ringWake(&p.incoming);
+    }
 
-        write(sockfd, header, 3);
-        write(sockfd, net_buffer, size);
+    // Handle User Input
+    if (FD_ISSET(STDIN_FILENO, &readfds)) {
+      int c = editorReadKey(STDIN_FILENO);
+      if (c == CTRL_C) {
+        // Hang up, so that the peer doesn't wait for us to come back.
+        // The send stage does it between packets, if it is quick.
+        atomic_store(&p.hangup, 1);
+        ringWake(&p.outgoing);
+        long long deadline = current_timestamp() + NET_HANGUP_MS;
+        while (atomic_load(&p.running) && current_timestamp() < deadline)
+          sleepUntil(current_timestamp() + 10);
+        break;
+      }
+      if (c == 'v' || c == 'V') {
+        int view = atomic_load(&E.view_mode);
+        atomic_store(&E.view_mode, view == VIEW_PIP ? VIEW_SPLIT : VIEW_PIP);
+        atomic_store(&p.redraw, 1);
+        ringWake(&p.incoming);
+      }
+
+      // Zoom and pan the picture of the peer: the send stage tells it
+      unsigned int view = moveView(atomic_load(&p.my_view), c);
+      if (view != atomic_load(&p.my_view)) {
+        atomic_store(&p.my_view, view);
+        ringWake(&p.outgoing);
+        if (atomic_load(&p.peer_features) & NET_FEATURE_VIEW) {
+          editorSetStatusMessage("Zoom %dx", 255 / (int)(view >> 16 & 0xff));
+        } else {
+          editorSetStatusMessage("The peer can't zoom.");
+        }
       }
-      next_frame_time = now + 33; // Target ~30 FPS
     }
   }
 
-  free(net_buffer);
-  free(recv_buffer);
-  free(last_peer_pixels);
-  close(sockfd);
+  // Stop every stage and wait for them to notice
+  atomic_store(&p.running, 0);
+  for (int i = 0; i < nrings; i++) ringWake(rings[i]);
+  for (int i = 0; i < nstages; i++) pthread_join(threads[i], NULL);
+  if (linking) {
+    pthread_join(link_thread, NULL);
+    if (atomic_load(&p.setup_result) == -1) close(p.setup_fd);
+  }
+
+  for (int i = 0; i < nrings; i++) ringFree(rings[i]);
+  pthread_mutex_destroy(&p.send_lock);
+  pthread_mutex_destroy(&p.control_lock);
+  if (p.sockfd != -1) close(p.sockfd);
+  if (p.outfd != p.sockfd) close(p.outfd);
+  if (listen_fd != -1) close(listen_fd);
+  if (dialing) dialStop(&dialer);
+  if (next_fd != -1) close(next_fd);
+  free(p.crypto.raw);
+  lzFree(&p.lz);
+  free(p.lz_out);
+
+  if (E.vt_check) {
+    /* Raw mode is still on: no newline translation. */
+    vtModel *vt = &p.vt;
+    fprintf(stderr, "\x1b[%d;1H\x1b[0K\r\n", E.screenrows + 1);
+    if (vt->error[0]) fprintf(stderr, "vt-check: FAILED: %s\r\n", vt->error);
+    else fprintf(stderr, "vt-check: OK\r\n");
+    if (vt->updates) {
+      fprintf(stderr, "vt-check: %lld updates, %lld bytes/update "
+          "(max %lld), %lld escapes/update\r\n", vt->updates,
+          vt->bytes / vt->updates, vt->max_bytes, vt->escapes / vt->updates);
+    }
+    vtFree(vt);
+  }
 }
 
 /* --- MIRROR MODE ---------------------------------------------------------- */
 
 void runMirrorMode(camera *cam) {
   frame frame;
+  rangeLock lock = {0, 0, 0};
 
   while (1) {
     /* Check for keypress to exit */
@@ -1560,6 +6136,9 @@ void runMirrorMode(camera *cam) {
       }
     }
 
+    /* Every frame is a full repaint, so just pick up the new size. */
+    handleWindowResize();
+
     if (cameraGetFrame(cam, &frame)) {
       struct abuf ab = ABUF_INIT;
 
@@ -1574,12 +6153,12 @@ void runMirrorMode(camera *cam) {
       abAppend(&ab,"\x1b[H",3); /* Go home. */
 
       renderBufferBGRA(&ab, frame.pixels, frame.width, frame.height,
-          0, 0, E.screencols, E.screenrows, 1);
+          0, 0, E.screencols, E.screenrows, 1, &lock);
 
       renderStatus(&ab);
 
-      // Write buffer to stdout and free
-      write(STDOUT_FILENO, ab.b, ab.len);
+      // Write buffer to stdout and free, unless the frame changed under us
+      if (cameraFrameIntact(cam)) write(STDOUT_FILENO, ab.b, ab.len);
       abFree(&ab);
     }
 
@@ -1589,6 +6168,166 @@ void runMirrorMode(camera *cam) {
   }
 }
 
+/* --- BROKER MODE ---------------------------------------------------------- */
+
+struct brokerPeer {
+  int sockfd;
+  int notify[2];
+};
+
+void brokerDropPeer(struct brokerPeer *peers, int *count, int i) {
+  close(peers[i].sockfd);
+  close(peers[i].notify[1]);
+  peers[i] = peers[--(*count)];
+}
+
+void brokerAccept(int listenfd, struct brokerPeer *peers, int *count) {
+  int s = accept(listenfd, NULL, NULL);
+  if (s == -1) return;
+  struct brokerPeer *bp = &peers[*count];
+  if (*count == BROKER_MAX_CLIENTS || brokerNotifyChannel(bp->notify) == -1) {
+    close(s);
+    return;
+  }
+  bp->sockfd = s;
+  int sent = brokerSendFd(s, bp->notify[0]);
+  if (bp->notify[0] != bp->notify[1]) close(bp->notify[0]);
+  if (sent == -1) {
+    close(s);
+    close(bp->notify[1]);
+    return;
+  }
+  (*count)++;
+}
+
+/* Copy a camera frame into the next slot and wake up every client. */
+void brokerPublish(struct brokerShm *shm, frame *f,
+                   struct brokerPeer *peers, int count) {
+  size_t size = (size_t)f->width * f->height * 4;
+  if (size > BROKER_MAX_FRAME) return;
+
+  unsigned int n = atomic_load(&shm->published);
+  int slot = n % BROKER_SLOTS;
+  unsigned char *data = (unsigned char *)shm + BROKER_DATA_OFFSET;
+  atomic_store(&shm->slots[slot].seq, 0);
+  atomic_thread_fence(memory_order_release); /* seq 0 lands before data. */
+  memcpy(data + (size_t)slot * BROKER_MAX_FRAME, f->pixels, size);
+  shm->slots[slot].width = f->width;
+  shm->slots[slot].height = f->height;
+  atomic_store(&shm->slots[slot].seq, n + 1);
+  atomic_store(&shm->published, n + 1);
+
+  for (int i = 0; i < count; i++) brokerNotify(peers[i].notify[1]);
+}
+
+void runBrokerMode(camera *cam) {
+  struct sockaddr_un addr;
+  char shm_name[32];
+  const char *device = E.camera_target[0] ? E.camera_target : "default";
+  if (brokerAddress(device, &addr, shm_name) == -1) {
+    fprintf(stderr, "Error: no private directory for the broker socket, "
+        "check $XDG_RUNTIME_DIR or /tmp/picturephone-%u.\n",
+        (unsigned int)getuid());
+    exit(1);
+  }
+  signal(SIGPIPE, SIG_IGN); /* Pipes of clients that just went away. */
+
+  /* Refuse to steal the names of a broker that is still serving. */
+  int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenfd == -1) {
+    perror("socket");
+    exit(1);
+  }
+  if (connect(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "Error: a camera broker for '%s' is already running.\n",
+        device);
+    exit(1);
+  }
+  close(listenfd);
+  unlink(addr.sun_path);
+  shm_unlink(shm_name);
+
+  int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  struct brokerShm *shm = MAP_FAILED;
+  if (fd != -1 && ftruncate(fd, BROKER_SHM_SIZE) == 0)
+    shm = mmap(NULL, BROKER_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd, 0);
+  if (fd != -1) close(fd);
+  if (shm == MAP_FAILED) {
+    perror("shm_open");
+    exit(1);
+  }
+  shm->magic = BROKER_MAGIC;
+
+  listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenfd == -1 ||
+      bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listenfd, 5) == -1) {
+    perror("bind");
+    shm_unlink(shm_name);
+    exit(1);
+  }
+
+  struct brokerPeer peers[BROKER_MAX_CLIENTS];
+  int count = 0, last_count = -1;
+  long long next_frame_time = current_timestamp();
+
+  while (1) {
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(STDIN_FILENO, &readfds);
+    FD_SET(listenfd, &readfds);
+    int maxfd = listenfd;
+    for (int i = 0; i < count; i++) {
+      FD_SET(peers[i].sockfd, &readfds);
+      if (peers[i].sockfd > maxfd) maxfd = peers[i].sockfd;
+    }
+
+    long long wait_ms = next_frame_time - current_timestamp();
+    if (wait_ms < 0) wait_ms = 0;
+    struct timeval tv = {wait_ms / 1000, (wait_ms % 1000) * 1000};
+
+    if (select(maxfd+1, &readfds, NULL, NULL, &tv) > 0) {
+      if (FD_ISSET(STDIN_FILENO, &readfds)) {
+        char c;
+        if (read(STDIN_FILENO, &c, 1) == 1 && c == CTRL_C) break;
+      }
+      if (FD_ISSET(listenfd, &readfds)) brokerAccept(listenfd, peers, &count);
+      /* Clients never talk: readable means they are gone. */
+      for (int i = count - 1; i >= 0; i--) {
+        if (FD_ISSET(peers[i].sockfd, &readfds))
+          brokerDropPeer(peers, &count, i);
+      }
+    }
+
+    if (current_timestamp() >= next_frame_time) {
+      frame frame;
+      if (cameraGetFrame(cam, &frame)) brokerPublish(shm, &frame, peers, count);
+      next_frame_time += 33; /* Target ~30 FPS */
+      long long now = current_timestamp();
+      if (next_frame_time < now) next_frame_time = now;
+    }
+
+    if (count != last_count) {
+      char buf[160];
+      int len = snprintf(buf, sizeof(buf), "\x1b[H\x1b[2J"
+          "Camera broker for '%s': %d client%s.\r\n\r\n"
+          "Use it with --camera broker%s%s | Ctrl-C = quit",
+          device, count, count == 1 ? "" : "s",
+          strcmp(device, "default") ? ":" : "",
+          strcmp(device, "default") ? device : "");
+      write(STDOUT_FILENO, buf, len);
+      last_count = count;
+    }
+  }
+
+  while (count > 0) brokerDropPeer(peers, &count, count - 1);
+  close(listenfd);
+  unlink(addr.sun_path);
+  shm_unlink(shm_name);
+  munmap(shm, BROKER_SHM_SIZE);
+}
+
 /* --- CONFIG TUI ----------------------------------------------------------- */
 
 // Simple text input in raw mode
@@ -1678,26 +6417,36 @@ int ttyMenu(const char *prompt, const char **options, int count) {
   }
 }
 
+/* Parse host:port, where an IPv6 host has brackets around it, as in
+ * [::1]:3000. A bare IPv6 address is taken as a host alone. */
 void parseIpPortString(char *str) {
-  char *colon = strchr(str, ':');
-  if (colon) {
+  char *colon = strrchr(str, ':');
+  if (str[0] == '[') {
+    char *end = strchr(str, ']');
+    if (end) {
+      *end = '\0';
+      if (end[1] == ':') E.net_port = atoi(end + 2);
+    }
+    str++;
+  } else if (colon && colon == strchr(str, ':')) {
     *colon = '\0';
-    strncpy(E.net_ip, str, 63);
     E.net_port = atoi(colon + 1);
-  } else {
-    strncpy(E.net_ip, str, 63);
   }
+  snprintf(E.net_ip, sizeof(E.net_ip), "%s", str);
 }
 
 void configureTUI(void) {
   const char *mode_opts[] = {
     "[Mirror Mode] See yourself in the mirror.",
-    "[Network Mode] Call a friend: create a room or join a call."
+    "[Network Mode] Call a friend: create a room or join a call.",
+    "[Broker Mode] Share a webcam with other local picturephones."
   };
-  int mode = ttyMenu("Select Mode:", mode_opts, 2);
+  int mode = ttyMenu("Select Mode:", mode_opts, 3);
 
   if (mode == 0) {
     E.mode = MODE_MIRROR;
+  } else if (mode == 2) {
+    E.mode = MODE_BROKER;
   } else {
     E.mode = MODE_NETWORK;
     const char *role_opts[] = {
@@ -1715,8 +6464,9 @@ void configureTUI(void) {
     } else {
       E.net_role = NET_ROLE_CLIENT;
       char buf[128];
-      snprintf(buf, sizeof(buf), "%s:%d", E.net_ip, E.net_port);
-      ttyInput("Enter IP:PORT:", buf, 127);
+      snprintf(buf, sizeof(buf), strchr(E.net_ip, ':') ? "[%s]:%d" : "%s:%d",
+          E.net_ip, E.net_port);
+      ttyInput("Enter HOST:PORT:", buf, 127);
       parseIpPortString(buf);
     }
   }
@@ -1759,10 +6509,23 @@ int main(int argc, char **argv) {
   initEditor();
 
   camera cam;
+  cam.notify_fd = -1;
 
   if (argc > 1) {
     parse_config_args(argc, argv);
 
+    if (E.crypto_bench) {
+      cryptoBench();
+      exit(0);
+    }
+
+    if (E.lz_bench) exit(lzBench() == 0 ? 0 : 1);
+
+    if (E.vt_selftest) {
+      resolveDensityConfig();
+      exit(vtSelftest() ? 1 : 0);
+    }
+
     if (E.list_cameras) {
       CameraInfo *list = enumerateCameras();
       fprintf(stdout, "Available Cameras:\n");
@@ -1773,6 +6536,13 @@ int main(int argc, char **argv) {
       exit(0);
     }
 
+    if (E.mode == MODE_NETWORK && E.net_role == NET_ROLE_STDIO &&
+        stdioSetup() == -1)
+    {
+      runStdioRelay();
+      exit(0);
+    }
+
     initTerminal();
     enableRawMode(STDIN_FILENO);
   } else {
@@ -1785,14 +6555,17 @@ int main(int argc, char **argv) {
   cameraInit(&cam, 640, 480);
   cameraStart(&cam);
 
-  char *mode_str = (E.mode == MODE_MIRROR) ? "mirror" : "network";
-  editorSetStatusMessage("HELP: Ctrl-C = quit | 'v' = toggle view | mode: %s",
-      mode_str);
+  char *mode_str = (E.mode == MODE_MIRROR) ? "mirror" :
+                   (E.mode == MODE_BROKER) ? "broker" : "network";
+  editorSetStatusMessage("HELP: Ctrl-C = quit | 'v' = toggle view | "
+      "+/- = zoom | mode: %s", mode_str);
 
   if (E.mode == MODE_MIRROR) {
     runMirrorMode(&cam);
   } else if (E.mode == MODE_NETWORK) {
     runNetworkMode(&cam);
+  } else if (E.mode == MODE_BROKER) {
+    runBrokerMode(&cam);
   }
 
   return 0;